@@ -0,0 +1,97 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "poller.h"
+#include "frame.h"
+
+#if defined(__linux)
+ #define FRAME_TIMERFD
+ #include <sys/timerfd.h>
+#endif
+
+static long long last_frame = 0;
+static long long deadline = -1; /* -1 when no frame is scheduled */
+static int timer_fd = -1;
+
+long long frame_millis(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#ifdef FRAME_TIMERFD
+static void on_timer(int fd, void *data, int events) {
+    uint64_t expirations;
+    /* Just consume the expiration, frame_due() checks the deadline */
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        perror("tersh: frame timer read failed");
+    }
+}
+
+static void arm_timer(long long at) {
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = at / 1000,
+            .tv_nsec = (at % 1000) * 1000000,
+        },
+    };
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        perror("tersh: timerfd_settime failed");
+    }
+}
+#endif
+
+int frame_init(void) {
+    last_frame = frame_millis();
+#ifdef FRAME_TIMERFD
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) return -1;
+    if (poller_add(timer_fd, NULL, on_timer) < 0) {
+        close(timer_fd);
+        timer_fd = -1;
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+void frame_request(int delay) {
+    long long at = frame_millis() + (delay > 0 ? delay : 0);
+    if (at < last_frame + FRAME_TIME) {
+        at = last_frame + FRAME_TIME;
+    }
+    if (deadline >= 0 && deadline <= at) return;
+    deadline = at;
+#ifdef FRAME_TIMERFD
+    if (timer_fd >= 0) arm_timer(at);
+#endif
+}
+
+void frame_damage(void) {
+    frame_request(0);
+}
+
+int frame_scheduled(void) {
+    return deadline >= 0;
+}
+
+int frame_due(void) {
+    return deadline >= 0 && frame_millis() >= deadline;
+}
+
+int frame_timeout(void) {
+    long long dt;
+    if (deadline < 0 || timer_fd >= 0) return -1;
+    dt = deadline - frame_millis();
+    return dt > 0 ? dt : 0;
+}
+
+unsigned int frame_begin(void) {
+    long long now = frame_millis();
+    long long dt = now - last_frame;
+    last_frame = now;
+    deadline = -1;
+    return dt < FRAME_MAX_DT ? dt : FRAME_MAX_DT;
+}
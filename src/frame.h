@@ -0,0 +1,70 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+/* Minimum time between frames in millis */
+#define FRAME_TIME 30
+
+/*
+ * Longest timedelta passed to widget updates, so waking from an idle
+ * sleep does not look like one very long frame to animations
+ */
+#define FRAME_MAX_DT 1000
+
+/*
+ * The frame clock schedules frames (widget update, layout and draw) only
+ * when there is something to show. Anything that changes what is on screen
+ * calls frame_damage(), and animating widgets call frame_request() from their
+ * update method to schedule their next frame. When nothing is pending, no
+ * frames are run at all.
+ *
+ * On Linux the clock is a monotonic timerfd watched by the poller, so the
+ * poller wakes up when a frame is due.
+ */
+
+/*
+ * Initialize the frame clock and register its timer with the poller.
+ *
+ * Returns 0 on success and -1 on error, setting errno.
+ */
+int frame_init(void);
+
+/*
+ * Returns the monotonic clock time in millis.
+ */
+long long frame_millis(void);
+
+/*
+ * Schedule a frame to run after delay millis, unless one is already
+ * scheduled sooner. Frames never run more often than FRAME_TIME.
+ */
+void frame_request(int delay);
+
+/*
+ * Schedule a frame as soon as possible because something on screen changed.
+ */
+void frame_damage(void);
+
+/*
+ * Returns non-zero if a frame is scheduled.
+ */
+int frame_scheduled(void);
+
+/*
+ * Returns non-zero if a scheduled frame is due to run now.
+ */
+int frame_due(void);
+
+/*
+ * Returns the time in millis until the next frame is due, to be used as a
+ * poll timeout. Returns -1 if no frame is scheduled or the poller will be
+ * woken by the frame timer.
+ */
+int frame_timeout(void);
+
+/*
+ * Start running a frame, clearing the schedule. Returns the timedelta
+ * in millis since the last frame.
+ */
+unsigned int frame_begin(void);
+
+#endif
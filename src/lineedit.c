@@ -1,5 +1,7 @@
 #include "BearLibTerminal.h"
+#include "frame.h"
 #include "lineedit.h"
+#include "width.h"
 
 int lineedit_insert(widget_t *w, wchar_t ch) {
     lineedit_t *le = widget_data(w, &lineedit_widget);
@@ -19,6 +21,7 @@ void lineedit_clear(widget_t *w) {
     le->buf.length = 0;
     le->curs = 0;
     le->curs_vis = 1;
+    le->idle = 0;
     le->state = lineedit_unchanged;
 }
 
@@ -26,6 +29,7 @@ void lineedit_was_changed(widget_t *w) {
     lineedit_t *le = widget_data(w, &lineedit_widget);
     le->state = lineedit_changed;
     le->curs_vis = 1;
+    le->idle = 0;
     w->flags |= WIDGET_NEEDS_REDRAW;
 }
 
@@ -114,17 +118,33 @@ int lineedit_handle_ev(widget_t *w, int event) {
 
 void lineedit_update(widget_t *w, unsigned int dt) {
     lineedit_t *le = widget_data(w, &lineedit_widget);
+    if (!le->blink_time) return;
+    if (le->blink_timeout && le->idle >= le->blink_timeout) {
+        /* stop blinking with the cursor shown so the frame clock can idle */
+        if (!le->curs_vis) {
+            le->curs_vis = 1;
+            w->flags |= WIDGET_NEEDS_REDRAW;
+        }
+        return;
+    }
+    le->idle += dt;
     le->elapsed += dt;
-    if (le->blink_time && le->elapsed >= le->blink_time) {
-        le->elapsed -= le->blink_time;
+    if (le->elapsed >= le->blink_time) {
+        le->elapsed %= le->blink_time;
         le->curs_vis = !le->curs_vis;
         w->flags |= WIDGET_NEEDS_REDRAW;
     }
+    frame_request(le->blink_time - le->elapsed);
 }
 
 void lineedit_layout(widget_t *w) {
     lineedit_t *le = widget_data(w, &lineedit_widget);
-    w->height = 1 + (le->buf.length + 2) / (w->width + 1);
+    int i, cols = 0;
+    wchar_t ch;
+    vec_foreach(&le->buf, ch, i) {
+        cols += char_width(ch);
+    }
+    w->height = 1 + (cols + 2) / (w->width + 1);
 }
 
 void lineedit_draw(widget_t *w) {
@@ -135,23 +155,39 @@ void lineedit_draw(widget_t *w) {
     int y = w->top;
     int x = w->left + 2;
     terminal_print(0, y, "[color=yellow]>[/color]");
-    int i;
+    int i, cw;
+    int curs_x = x, curs_y = y;
     wchar_t ch;
     vec_foreach(&le->buf, ch, i) {
-        terminal_put(x++, y, ch);
+        cw = char_width(ch);
+        if (cw == 2 && x + 1 > w->left + w->width) {
+            /* don't split a wide char across lines */
+            x = 0;
+            y++;
+        }
+        if (i == le->curs) {
+            curs_x = x;
+            curs_y = y;
+        }
+        if (cw) {
+            terminal_put(x, y, ch);
+            x += cw;
+        }
         if (x > w->left + w->width) {
             x = 0;
             y++;
         }
     }
+    if (le->curs >= le->buf.length) {
+        curs_x = x;
+        curs_y = y;
+    }
     // Draw cursor
     terminal_layer(1);
     terminal_clear_area(w->left, w->top, w->width, w->height);
     if (le->curs_vis) {
         int cellw = terminal_state(TK_CELL_WIDTH);
-        x = w->left + (le->curs + 2) % (w->width + 1);
-        y = w->top + (le->curs + 2) / (w->width + 1);
-        terminal_put_ext(x, y, -cellw / 2 + 1, -2, 0x007C, NULL);
+        terminal_put_ext(curs_x, curs_y, -cellw / 2 + 1, -2, 0x007C, NULL);
     }
     terminal_layer(0);
 }
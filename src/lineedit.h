@@ -10,7 +10,8 @@ typedef enum {
 
 typedef struct {
     int curs, curs_vis;
-    unsigned int blink_time, elapsed;
+    /* blink_timeout stops blinking after that many idle millis, 0 never */
+    unsigned int blink_time, blink_timeout, elapsed, idle;
     lineedit_state_e state;
     vec_wchar_t buf;
 } lineedit_t;
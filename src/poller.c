@@ -2,27 +2,165 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include "smalloc.h"
 #include "poller.h"
 
+#if defined(__linux) && !defined(POLLER_NO_EPOLL)
+ #define POLLER_EPOLL
+ #include <sys/epoll.h>
+#endif
+
+#define MAX_EVENTS 64
+
 struct pollee {
     int fd;
+    int events;
     void *data;
     poller_cb cb;
 };
 
-vec_t(struct pollee) pollees = NULL_VEC;
+smalloc_pool_t pollee_pool = SMALLOC_POOL(sizeof(struct pollee));
+vec_t(struct pollee *) pollees = NULL_VEC;
+static int dead_count = 0;
+
+#ifdef POLLER_EPOLL
+/*
+ * The epoll instance keeps a persistent registration for each pollee, so
+ * a poll only costs work for the fds that are actually ready. If epoll is
+ * unavailable at runtime, epfd stays < 0 and the poll() path is used.
+ */
+static int epfd = -1;
+static int epoll_failed = 0;
+
+static int epoll_fd() {
+    if (epfd < 0 && !epoll_failed) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+            perror("tersh: epoll_create1 failed, falling back to poll");
+            epoll_failed = 1;
+        }
+    }
+    return epfd;
+}
+
+static int epoll_register(struct pollee *p, int op) {
+    struct epoll_event ev = {
+        .events = (p->events & POLLIN ? EPOLLIN : 0) |
+                  (p->events & POLLOUT ? EPOLLOUT : 0),
+        .data.ptr = p,
+    };
+    return epoll_ctl(epfd, op, p->fd, &ev);
+}
+
+static int epoll_poll(int timeout) {
+    int i, retval;
+    struct epoll_event events[MAX_EVENTS];
+    struct pollee *p;
+
+    retval = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    if (retval <= 0) return retval;
+
+    for (i = 0; i < retval; i++) {
+        int revents = 0;
+        p = events[i].data.ptr;
+        /* skip pollees removed by an earlier callback in this batch */
+        if (p->fd < 0) continue;
+        if (events[i].events & EPOLLIN) revents |= POLLIN;
+        if (events[i].events & EPOLLOUT) revents |= POLLOUT;
+        if (events[i].events & EPOLLERR) revents |= POLLERR;
+        if (events[i].events & EPOLLHUP) revents |= POLLHUP;
+        p->cb(p->fd, p->data, revents);
+    }
+
+    return retval;
+}
+#endif
+
+static void prune() {
+    int i;
+    struct pollee *p;
+
+    for (i = pollees.length - 1; i >= 0; i--) {
+        p = pollees.data[i];
+        if (p->fd < 0) {
+            vec_del(&pollees, i);
+            smfree(&pollee_pool, p);
+        }
+    }
+    dead_count = 0;
+}
 
 int poller_add(int fd, void* data, poller_cb cb) {
     int err;
+    struct pollee *p;
     assert(cb);
-    err = vec_push(&pollees, ((struct pollee){ fd, data, cb }));
+    p = smalloc(&pollee_pool);
+    if (p == NULL) return -1;
+    *p = (struct pollee){ fd, POLLIN, data, cb };
+#ifdef POLLER_EPOLL
+    if (epoll_fd() >= 0 && epoll_register(p, EPOLL_CTL_ADD) < 0) {
+        smfree(&pollee_pool, p);
+        return -1;
+    }
+#endif
+    err = vec_push(&pollees, p);
+    if (err) {
+        smfree(&pollee_pool, p);
+    }
     return err;
 }
 
+int poller_del(int fd) {
+    int i;
+    struct pollee *p;
+
+    for (i = pollees.length - 1; i >= 0; i--) {
+        p = pollees.data[i];
+        if (p->fd == fd) {
+#ifdef POLLER_EPOLL
+            if (epfd >= 0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+            }
+#endif
+            /* freed by the next poll, after any pending dispatch */
+            p->fd = -1;
+            dead_count++;
+            return 0;
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+int poller_set_events(int fd, int events) {
+    int i;
+    struct pollee *p;
+
+    for (i = pollees.length - 1; i >= 0; i--) {
+        p = pollees.data[i];
+        if (p->fd == fd) {
+            if (p->events == events) return 0;
+            p->events = events;
+#ifdef POLLER_EPOLL
+            if (epfd >= 0) {
+                return epoll_register(p, EPOLL_CTL_MOD);
+            }
+#endif
+            return 0;
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+int poller_count() {
+    return pollees.length - dead_count;
+}
+
 void *poller_getfg() {
     for (int i = pollees.length - 1; i >= 0; i--) {
-        if (pollees.data[i].fd >= 0) {
-            return pollees.data[i].data;
+        if (pollees.data[i]->fd >= 0) {
+            return pollees.data[i]->data;
         }
     }
     return NULL;
@@ -30,19 +168,21 @@ void *poller_getfg() {
 
 int poller_poll(int timeout) {
     int i, retval, count;
-    struct pollfd pollfds[pollees.length];
     struct pollee *p;
 
-    // Prune closed fds
-    for (i = pollees.length - 1; i >= 0; i--) {
-        if (pollees.data[i].fd < 0) {
-            vec_del(&pollees, i);
-        }
+    if (dead_count) prune();
+
+#ifdef POLLER_EPOLL
+    if (epfd >= 0) {
+        return epoll_poll(timeout);
     }
+#endif
+
+    struct pollfd pollfds[pollees.length];
 
     for (i = 0; i < pollees.length; i++) {
-        pollfds[i].fd = pollees.data[i].fd;
-        pollfds[i].events = POLLIN | POLLOUT;
+        pollfds[i].fd = pollees.data[i]->fd;
+        pollfds[i].events = pollees.data[i]->events;
         pollfds[i].revents = 0;
     }
 
@@ -50,8 +190,9 @@ int poller_poll(int timeout) {
     if (retval <= 0) return retval;
 
     count = retval;
-    for (i = 0, p = pollees.data; i < pollees.length; i++, p++) {
+    for (i = 0; i < pollees.length; i++) {
         short revents = pollfds[i].revents;
+        p = pollees.data[i];
         if (revents) {
             /*
             printf("fd=%d events:", p->fd);
@@ -62,11 +203,15 @@ int poller_poll(int timeout) {
             if (revents & POLLERR) printf(" POLLERR");
             printf("\n");
             */
-            if (revents & POLLNVAL && p->fd > 0) {
-                // fd was closed somewhere, mark it closed
-                p->fd = -p->fd;
+            if (p->fd < 0) {
+                /* removed by an earlier callback */
+            } else if (revents & POLLNVAL) {
+                // fd was closed somewhere, drop it
+                p->fd = -1;
+                dead_count++;
+            } else {
+                p->cb(p->fd, p->data, revents);
             }
-            p->cb(p->fd, p->data, revents);
             if (--count == 0) break;
         }
     }
@@ -21,13 +21,40 @@ typedef void (*poller_cb)(int fd, void *data, int events);
 /*
  * Add a new fd to poll, associated with the data pointer. Events on the file
  * and process are sent to cb.  This becomes the new forground process and fd.
+ * The fd is initially polled for POLLIN only, use poller_set_events() to
+ * change this.
  *
- * When the fd is closed, it is automatically removed from the poller.
+ * The fd stays registered with the poller until poller_del() is called.
+ * Callers should remove the fd before closing it, though fds found to be
+ * closed are dropped automatically.
  *
  * Returns 0 on success and -1 on error, setting errno.
  */
 int poller_add(int fd, void *data, poller_cb cb);
 
+/*
+ * Remove an fd from the poller. This is safe to call from within a poller
+ * callback, no further callbacks are dispatched for the fd.
+ *
+ * Returns 0 on success and -1 if the fd is not registered, setting errno.
+ */
+int poller_del(int fd);
+
+/*
+ * Change the set of poll events (POLLIN and/or POLLOUT) the fd is polled
+ * for. POLLHUP and POLLERR are always reported. Fds that are almost always
+ * writable, like ptys, should only ask for POLLOUT while they have pending
+ * output, otherwise the poller never sleeps.
+ *
+ * Returns 0 on success and -1 on error, setting errno.
+ */
+int poller_set_events(int fd, int events);
+
+/*
+ * Returns the number of fds currently registered with the poller.
+ */
+int poller_count();
+
 /*
  * Returns the data pointer for the current foreground process, or
  * NULL if there is no currently running fg process.
@@ -36,7 +63,8 @@ void *poller_getfg();
 
 /*
  * Poll all active files in the poller and dispatch callbacks for any events
- * available.
+ * available. On Linux this uses epoll, so only ready fds cost any work,
+ * otherwise (or if epoll is unavailable) it falls back to poll().
  *
  * The poller will wait until the timeout for an event to occur, but may
  * return early if events are available sooner.
@@ -0,0 +1,517 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "vec.h"
+#include "ptyreader.h"
+#include "uring.h"
+
+#if defined(URING_AVAILABLE) && !defined(PTYREADER_NO_URING)
+ #define PTYREADER_URING
+#endif
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define exchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define store_seq_cst(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+struct ptysrc {
+    int fd;
+    void *data;
+    ring_t ring;
+    size_t limit; /* stop reading once this many bytes are unread */
+    int closed;  /* set by the reader, no more output will arrive */
+    int stalled; /* set by the reader when it stopped reading a full ring */
+    int paused;  /* set along with stalled, cleared by ptyreader_paused() */
+#ifdef PTYREADER_URING
+    uring_bufs_t bufs;
+    int setup;    /* bufs are registered */
+    int nobufs;   /* bufs couldn't be registered, poll and read() instead */
+    int armed;    /* a multishot read or a poll is in flight */
+    int eof;      /* closed once the pending buffers are copied */
+    /* filled buffers waiting for space in the ring, oldest first */
+    struct {
+        int bid;
+        int len;
+        int offs;
+    } pending[PTYREADER_URING_BUFS];
+    int pending_start;
+    int npending;
+#endif
+};
+
+typedef vec_t(ptysrc_t *) vec_ptysrc_t;
+
+static pthread_t thread;
+static int started = 0;
+static poller_cb ui_cb;
+
+/* sources read by the reader thread, guarded by lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static vec_ptysrc_t reader_srcs = NULL_VEC;
+
+/* sources consumed by the UI thread, only touched by the UI thread */
+static vec_ptysrc_t ui_srcs = NULL_VEC;
+
+/* wakes the reader thread when sources were added or a ring has space */
+static int reader_wake[2] = {-1, -1};
+/* wakes the UI thread's poller when there is output to consume */
+static int ui_wake[2] = {-1, -1};
+static int ui_wake_pending = 0;
+
+static int make_pipe(int fds[2]) {
+    if (pipe(fds) < 0) return -1;
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    }
+    return 0;
+}
+
+static void drain_pipe(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+static void poke(int fd) {
+    if (write(fd, "", 1) < 0 && errno != EAGAIN) {
+        perror("tersh: wake pipe write failed");
+    }
+}
+
+static void wake_ui() {
+    /* only one wakeup is needed until the UI thread has looked */
+    if (!exchange(&ui_wake_pending, 1)) {
+        poke(ui_wake[1]);
+    }
+}
+
+/* Returns how many more bytes the reader may put in the source's ring */
+static size_t src_space(ptysrc_t *src) {
+    size_t used = ring_used(&src->ring);
+    return used < src->limit ? src->limit - used : 0;
+}
+
+/*
+ * Read from the pty into its ring until it would block or the limit is hit.
+ * Returns 0 at EOF, otherwise 1.
+ */
+static int read_src(ptysrc_t *src) {
+    size_t len, space;
+    ssize_t r;
+    char *p;
+
+    for (;;) {
+        p = ring_reserve(&src->ring, &len);
+        space = src_space(src);
+        if (len > space) len = space;
+        if (len == 0) return 1;
+        r = read(src->fd, p, len);
+        if (r == 0 || (r < 0 && errno == EIO)) return 0;
+        if (r < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            perror("tersh: pty read failed");
+            return 0;
+        }
+        ring_commit(&src->ring, r);
+        wake_ui();
+    }
+}
+
+/* Called by the reader thread once no more output will arrive */
+static void close_src(ptysrc_t *src) {
+    pthread_mutex_lock(&lock);
+    vec_remove(&reader_srcs, src);
+    pthread_mutex_unlock(&lock);
+    /* src belongs to the UI thread once closed is set */
+    store_release(&src->closed, 1);
+    wake_ui();
+}
+
+static void *reader_main(void *arg) {
+    vec_t(struct pollfd) pollfds = NULL_VEC;
+    vec_ptysrc_t polled = NULL_VEC;
+    ptysrc_t *src;
+    int i;
+
+    for (;;) {
+        vec_clear(&pollfds);
+        vec_clear(&polled);
+        vec_push(&pollfds, ((struct pollfd){ reader_wake[0], POLLIN, 0 }));
+        vec_push(&polled, NULL);
+        pthread_mutex_lock(&lock);
+        vec_foreach(&reader_srcs, src, i) {
+            if (!src_space(src)) {
+                /*
+                 * Full, wait for the UI to catch up. Check again after
+                 * setting stalled, in case the UI read everything before it
+                 * could see the flag.
+                 */
+                store_seq_cst(&src->stalled, 1);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (!src_space(src)) {
+                    store_release(&src->paused, 1);
+                    continue;
+                }
+                store_seq_cst(&src->stalled, 0);
+            }
+            vec_push(&pollfds, ((struct pollfd){ src->fd, POLLIN, 0 }));
+            vec_push(&polled, src);
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (poll(pollfds.data, pollfds.length, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("tersh: pty reader poll failed");
+            break;
+        }
+        if (pollfds.data[0].revents) {
+            drain_pipe(reader_wake[0]);
+        }
+        for (i = 1; i < pollfds.length; i++) {
+            if (!pollfds.data[i].revents) continue;
+            src = polled.data[i];
+            if (read_src(src)) continue;
+            /* EOF, stop reading and let the UI close up */
+            close_src(src);
+        }
+    }
+    vec_deinit(&pollfds);
+    vec_deinit(&polled);
+    return NULL;
+}
+
+#ifdef PTYREADER_URING
+/*
+ * With io_uring, each pty has a multishot read that fills buffers from its
+ * own provided buffer group, and the reader thread copies filled buffers
+ * into the ring. Once a pty has no free buffers left its read ends with
+ * ENOBUFS, and is rearmed when the UI has made space in the ring. A pty
+ * whose buffers can't be registered is polled instead, and read with read()
+ * like reader_main() does.
+ */
+static uring_t uring;
+static int use_uring = 0;
+static unsigned short next_bgid = 0;
+
+static void arm_wake(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&uring);
+    if (sqe == NULL) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = reader_wake[0];
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = 0;
+}
+
+static void arm_poll(ptysrc_t *src) {
+    struct io_uring_sqe *sqe;
+
+    if (!src_space(src)) {
+        /* full, same dance as in reader_main() */
+        store_seq_cst(&src->stalled, 1);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!src_space(src)) {
+            store_release(&src->paused, 1);
+            return;
+        }
+        store_seq_cst(&src->stalled, 0);
+    }
+    sqe = uring_get_sqe(&uring);
+    if (sqe == NULL) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = src->fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (unsigned long)src;
+    src->armed = 1;
+}
+
+static void arm_read(ptysrc_t *src) {
+    struct io_uring_sqe *sqe;
+
+    if (src->armed || src->eof || src->npending == PTYREADER_URING_BUFS) return;
+    if (src->nobufs) {
+        arm_poll(src);
+        return;
+    }
+    sqe = uring_get_sqe(&uring);
+    if (sqe == NULL) return;
+    sqe->opcode = URING_OP_READ_MULTISHOT;
+    sqe->fd = src->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = src->bufs.bgid;
+    sqe->user_data = (unsigned long)src;
+    src->armed = 1;
+}
+
+static int setup_src(ptysrc_t *src) {
+    int i;
+
+    /* skip any group ids still in use after wrapping around */
+    for (i = 0; i < 16; i++) {
+        if (uring_bufs_init(&uring, &src->bufs, next_bgid++,
+                    PTYREADER_URING_BUFS, PTYREADER_URING_BUF_SIZE) == 0) {
+            src->setup = 1;
+            return 0;
+        }
+        if (errno != EEXIST) break;
+    }
+    perror("tersh: failed to register pty read buffers, using read()");
+    return -1;
+}
+
+/*
+ * Copy the pending buffers into the ring as far as they fit, handing the
+ * emptied ones back to the kernel.
+ */
+static void flush_pending(ptysrc_t *src) {
+    int i, n, recycled = 0;
+    size_t space;
+
+    while (src->npending) {
+        i = src->pending_start;
+        n = src->pending[i].len - src->pending[i].offs;
+        space = src_space(src);
+        if ((size_t)n > space) n = space;
+        n = ring_write(&src->ring,
+                uring_buf(&src->bufs, src->pending[i].bid) + src->pending[i].offs, n);
+        if (n) wake_ui();
+        src->pending[i].offs += n;
+        if (src->pending[i].offs < src->pending[i].len) {
+            /* full, same dance as in reader_main() */
+            store_seq_cst(&src->stalled, 1);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (!src_space(src)) {
+                store_release(&src->paused, 1);
+                break;
+            }
+            store_seq_cst(&src->stalled, 0);
+            continue;
+        }
+        uring_buf_recycle(&src->bufs, src->pending[i].bid);
+        src->pending_start = (i + 1) % PTYREADER_URING_BUFS;
+        src->npending--;
+        recycled = 1;
+    }
+    if (recycled) arm_read(src);
+}
+
+static void finish_src(ptysrc_t *src) {
+    if (src->setup) {
+        uring_bufs_deinit(&uring, &src->bufs);
+        src->setup = 0;
+    }
+    close_src(src);
+}
+
+static void on_read(ptysrc_t *src, int res, unsigned flags) {
+    int i;
+
+    if (src->nobufs) {
+        /* a poll completed */
+        src->armed = 0;
+        if (res > 0 && !read_src(src)) {
+            src->eof = 1;
+        } else if (res < 0 && res != -EINTR && res != -ECANCELED) {
+            errno = -res;
+            perror("tersh: pty poll failed");
+            src->eof = 1;
+        } else {
+            arm_read(src);
+        }
+        if (src->eof) finish_src(src);
+        return;
+    }
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        i = (src->pending_start + src->npending) % PTYREADER_URING_BUFS;
+        src->pending[i].bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        src->pending[i].len = res;
+        src->pending[i].offs = 0;
+        src->npending++;
+        flush_pending(src);
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        src->armed = 0;
+        if (res == 0 || res == -EIO) {
+            src->eof = 1;
+        } else if (res < 0 && res != -ENOBUFS && res != -EAGAIN &&
+                res != -EINTR && res != -ECANCELED) {
+            errno = -res;
+            perror("tersh: pty read failed");
+            src->eof = 1;
+        } else {
+            arm_read(src);
+        }
+    }
+    if (src->eof && !src->npending) finish_src(src);
+}
+
+/* Set up new sources and resume those the UI has made space for */
+static void update_srcs(vec_ptysrc_t *srcs) {
+    ptysrc_t *src;
+    int i;
+
+    pthread_mutex_lock(&lock);
+    vec_clear(srcs);
+    vec_extend(srcs, &reader_srcs);
+    pthread_mutex_unlock(&lock);
+
+    vec_foreach(srcs, src, i) {
+        if (!src->setup && !src->nobufs && setup_src(src) < 0) {
+            /* a job must not hang up for want of buffers, read it anyway */
+            src->nobufs = 1;
+        }
+        flush_pending(src);
+        arm_read(src);
+        if (src->eof && !src->npending) finish_src(src);
+    }
+}
+
+static void *reader_main_uring(void *arg) {
+    vec_ptysrc_t srcs = NULL_VEC;
+    struct io_uring_cqe *cqe;
+    unsigned long user_data;
+    unsigned flags;
+    int res, woken;
+
+    arm_wake();
+    for (;;) {
+        if (uring_submit(&uring, 1) < 0 && errno != EINTR) {
+            perror("tersh: pty reader io_uring_enter failed");
+            break;
+        }
+        woken = 0;
+        while ((cqe = uring_peek_cqe(&uring))) {
+            user_data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            uring_cqe_seen(&uring);
+            if (user_data) {
+                on_read((ptysrc_t *)user_data, res, flags);
+            } else {
+                woken = 1;
+                if (!(flags & IORING_CQE_F_MORE)) arm_wake();
+            }
+        }
+        if (woken) {
+            drain_pipe(reader_wake[0]);
+            update_srcs(&srcs);
+        }
+    }
+    vec_deinit(&srcs);
+    return NULL;
+}
+#endif
+
+static void on_ui_wake(int fd, void *data, int events) {
+    ptysrc_t *src;
+    int i, ev;
+
+    drain_pipe(fd);
+    store_release(&ui_wake_pending, 0);
+    /* iterate in reverse, the callback may delete the source */
+    vec_foreach_rev(&ui_srcs, src, i) {
+        if ((ev = ptyreader_events(src))) {
+            ui_cb(src->fd, src->data, ev);
+        }
+    }
+}
+
+int ptyreader_start(poller_cb cb) {
+    int err;
+
+    if (started) return 0;
+    ui_cb = cb;
+    if (make_pipe(reader_wake) < 0) return -1;
+    if (make_pipe(ui_wake) < 0) goto close_reader_wake;
+    if (poller_add(ui_wake[0], NULL, on_ui_wake) < 0) goto close_ui_wake;
+#ifdef PTYREADER_URING
+    use_uring = uring_init(&uring, 64) == 0;
+    err = pthread_create(&thread, NULL,
+            use_uring ? reader_main_uring : reader_main, NULL);
+#else
+    err = pthread_create(&thread, NULL, reader_main, NULL);
+#endif
+    if (err) {
+        fprintf(stderr, "tersh: failed to create pty reader thread: %s\n",
+                strerror(err));
+        poller_del(ui_wake[0]);
+        goto close_ui_wake;
+    }
+    started = 1;
+    return 0;
+
+close_ui_wake:
+    close(ui_wake[0]);
+    close(ui_wake[1]);
+close_reader_wake:
+    close(reader_wake[0]);
+    close(reader_wake[1]);
+    return -1;
+}
+
+ptysrc_t *ptyreader_add(int fd, void *data, size_t limit) {
+    ptysrc_t *src;
+
+    if (!started) return NULL;
+    src = calloc(1, sizeof(ptysrc_t));
+    if (src == NULL) return NULL;
+    if (ring_init(&src->ring, PTYREADER_RING_SIZE) < 0) {
+        free(src);
+        return NULL;
+    }
+    src->fd = fd;
+    src->data = data;
+    src->limit = limit && limit < src->ring.size ? limit : src->ring.size;
+    if (vec_push(&ui_srcs, src) < 0) goto error;
+    pthread_mutex_lock(&lock);
+    if (vec_push(&reader_srcs, src) < 0) {
+        pthread_mutex_unlock(&lock);
+        vec_pop(&ui_srcs);
+        goto error;
+    }
+    pthread_mutex_unlock(&lock);
+    poke(reader_wake[1]);
+    return src;
+
+error:
+    ring_deinit(&src->ring);
+    free(src);
+    return NULL;
+}
+
+void ptyreader_del(ptysrc_t *src) {
+    vec_remove(&ui_srcs, src);
+    ring_deinit(&src->ring);
+    free(src);
+}
+
+size_t ptyreader_read(ptysrc_t *src, char *buf, size_t n) {
+    n = ring_read(&src->ring, buf, n);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (n && exchange(&src->stalled, 0)) {
+        /* there is space in the ring again */
+        poke(reader_wake[1]);
+    }
+    return n;
+}
+
+int ptyreader_events(ptysrc_t *src) {
+    int events = 0;
+    if (load_acquire(&src->closed)) events |= POLLHUP;
+    if (ring_used(&src->ring)) events |= POLLIN;
+    return events;
+}
+
+int ptyreader_paused(ptysrc_t *src) {
+    return exchange(&src->paused, 0);
+}
+
+int ptyreader_eof(ptysrc_t *src) {
+    return load_acquire(&src->closed) && !ring_used(&src->ring);
+}
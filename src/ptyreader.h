@@ -0,0 +1,78 @@
+#include "ring.h"
+#include "poller.h"
+
+#ifndef PTYREADER_H
+#define PTYREADER_H
+
+/* Max bytes buffered per pty between the reader thread and the UI */
+#define PTYREADER_RING_SIZE (1 << 20)
+/* Buffers per pty for io_uring reads, the count must be a power of two */
+#define PTYREADER_URING_BUFS 16
+#define PTYREADER_URING_BUF_SIZE (16 * 1024)
+
+/*
+ * The pty reader moves reading pty output off the UI thread. A dedicated
+ * thread polls the pty masters handed to it and reads their output into a
+ * ring per pty. When new output arrives, it wakes the UI thread's poller,
+ * which dispatches the ptys with output to consume to the callback given to
+ * ptyreader_start(). The UI thread then takes output out of the rings with
+ * ptyreader_read() at its own pace.
+ *
+ * A pty with more unread output than its limit is not read until the UI
+ * thread catches up, leaving the kernel's pty flow control to throttle the
+ * child.
+ *
+ * On Linux the reader thread uses io_uring multishot reads into provided
+ * buffers where the kernel supports them, so reading a busy pty doesn't
+ * cost a read() per chunk. Otherwise it falls back to poll() and read().
+ *
+ * Writing to the ptys stays with the UI thread.
+ */
+typedef struct ptysrc ptysrc_t;
+
+/*
+ * Start the reader thread. cb is called from the UI thread's poller with
+ * POLLIN when a pty has output to read, and POLLIN | POLLHUP when the pty
+ * was closed by the other side.
+ *
+ * Returns 0 on success, or if already started, and -1 on error.
+ */
+int ptyreader_start(poller_cb cb);
+
+/*
+ * Hand the fd over to the reader thread, data is passed on to the callback.
+ * Reading stops while more than limit bytes are unread, 0 means
+ * PTYREADER_RING_SIZE. Returns the pty source, or NULL on error.
+ */
+ptysrc_t *ptyreader_add(int fd, void *data, size_t limit);
+
+/*
+ * Remove and free the pty source once ptyreader_eof() is true, before its
+ * fd is closed.
+ */
+void ptyreader_del(ptysrc_t *src);
+
+/*
+ * Copy up to n bytes of pty output into buf. Returns the number of bytes
+ * copied, which is 0 when no output is available.
+ */
+size_t ptyreader_read(ptysrc_t *src, char *buf, size_t n);
+
+/*
+ * Returns the poll events for the pty source: POLLIN if it has output to
+ * read, POLLHUP if it was closed.
+ */
+int ptyreader_events(ptysrc_t *src);
+
+/*
+ * Returns non-zero if the reader stopped reading the pty because its unread
+ * output hit the limit, at any point since the last call.
+ */
+int ptyreader_paused(ptysrc_t *src);
+
+/*
+ * Returns non-zero once the pty was closed and all its output was read.
+ */
+int ptyreader_eof(ptysrc_t *src);
+
+#endif
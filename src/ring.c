@@ -0,0 +1,69 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+int ring_init(ring_t *r, size_t size) {
+    assert(size && (size & (size - 1)) == 0);
+    r->data = malloc(size);
+    if (r->data == NULL) return -1;
+    r->size = size;
+    r->head = r->tail = 0;
+    return 0;
+}
+
+void ring_deinit(ring_t *r) {
+    free(r->data);
+    r->data = NULL;
+    r->size = 0;
+}
+
+size_t ring_used(ring_t *r) {
+    return load_acquire(&r->head) - load_acquire(&r->tail);
+}
+
+char *ring_reserve(ring_t *r, size_t *len) {
+    size_t head = r->head;
+    size_t free = r->size - (head - load_acquire(&r->tail));
+    size_t offs = head & (r->size - 1);
+    size_t contig = r->size - offs;
+    *len = free < contig ? free : contig;
+    return r->data + offs;
+}
+
+void ring_commit(ring_t *r, size_t n) {
+    store_release(&r->head, r->head + n);
+}
+
+size_t ring_write(ring_t *r, const char *src, size_t n) {
+    size_t len, done = 0;
+    char *p;
+
+    while (done < n) {
+        p = ring_reserve(r, &len);
+        if (len == 0) break;
+        if (len > n - done) len = n - done;
+        memcpy(p, src + done, len);
+        ring_commit(r, len);
+        done += len;
+    }
+    return done;
+}
+
+size_t ring_read(ring_t *r, char *dst, size_t n) {
+    size_t tail = r->tail;
+    size_t used = load_acquire(&r->head) - tail;
+    size_t offs, chunk;
+
+    if (n > used) n = used;
+    offs = tail & (r->size - 1);
+    chunk = r->size - offs;
+    if (chunk > n) chunk = n;
+    memcpy(dst, r->data + offs, chunk);
+    memcpy(dst + chunk, r->data, n - chunk);
+    store_release(&r->tail, tail + n);
+    return n;
+}
@@ -0,0 +1,59 @@
+/*
+ * Single producer, single consumer byte ring buffer.
+ *
+ * One thread may write to the ring while another reads from it without
+ * locking. The size must be a power of two.
+ */
+#include <stddef.h>
+
+#ifndef RING_H
+#define RING_H
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t head; /* total bytes written, only changed by the producer */
+    size_t tail; /* total bytes read, only changed by the consumer */
+} ring_t;
+
+/*
+ * Allocate the ring's buffer. Returns 0 on success, -1 on error.
+ */
+int ring_init(ring_t *r, size_t size);
+
+/*
+ * Free the ring's buffer.
+ */
+void ring_deinit(ring_t *r);
+
+/*
+ * Returns the number of bytes available to read. Safe to call from either
+ * side, though from the producer it may be stale.
+ */
+size_t ring_used(ring_t *r);
+
+/*
+ * Producer: return a pointer to contiguous free space in the ring and store
+ * its length in len. This can be read() into directly, then ring_commit()
+ * the bytes written. len is 0 if the ring is full.
+ */
+char *ring_reserve(ring_t *r, size_t *len);
+
+/*
+ * Producer: publish n bytes written into the space from ring_reserve().
+ */
+void ring_commit(ring_t *r, size_t n);
+
+/*
+ * Producer: copy up to n bytes from src into the ring. Returns the number of
+ * bytes copied, less than n if the ring filled up.
+ */
+size_t ring_write(ring_t *r, const char *src, size_t n);
+
+/*
+ * Consumer: copy up to n bytes out of the ring into dst. Returns the number
+ * of bytes copied.
+ */
+size_t ring_read(ring_t *r, char *dst, size_t n);
+
+#endif
@@ -3,6 +3,9 @@
  * forked from st: git://git.suckless.org/st
  * License: MIT/X https://git.suckless.org/st/file/LICENSE.html
  */
+#if defined(__linux)
+ #define _GNU_SOURCE /* for mkostemp() */
+#endif
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -15,16 +18,27 @@
 #include <string.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
 #include <wchar.h>
 
+#include "frame.h"
+#include "ptyreader.h"
 #include "st.h"
 #include "st_config.h"
 #include "st_widget.h"
+#include "width.h"
+
+#if   defined(__AVX2__)
+ #include <immintrin.h>
+#elif defined(__SSE2__)
+ #include <emmintrin.h>
+#endif
 
 #if   defined(__linux)
  #include <pty.h>
@@ -44,22 +58,32 @@ static void execsh(char *, char **);
 static void stty(char **);
 static ssize_t write_buf(Term *term, const char *s, size_t n);
 static void ttywriteraw(Term *, const char *, size_t);
+static void ttywritev(Term *, struct iovec *, int);
+static void ttysetevents(Term *);
+static void ttydefer(Term *);
 
 static void csidump(Term *);
 static void csihandle(Term *);
 static void csiparse(Term *);
+static void csidispatch(Term *);
 static void csireset(Term *);
-static int eschandle(Term *,uchar);
+static void eschandle(Term *, uchar);
 static void strdump(Term *);
 static void strhandle(Term *);
 static void strparse(Term *);
 static void strreset(Term *);
+static void strput(Term *, const char *, size_t);
+static void strb64(Term *, const char *, size_t);
+static int strb64quad(Term *);
+static void strb64end(Term *);
 
 static void tprinter(Term *, char *, size_t);
 static void tdumpsel(Term *);
 static void tdumpline(Term *, int);
 static void tdump(Term *);
 static void tclearregion(Term *, int, int, int, int);
+static void tfillglyph(Glyph *, const Glyph *, int);
+static int tlineattr(Term *, int);
 static void tcursor(Term *, int);
 static void tdeletechar(Term *, int);
 static void tdeleteline(Term *, int);
@@ -71,24 +95,42 @@ static void tmoveato(Term *, int, int);
 static void tnewline(Term *, int);
 static void tputtab(Term *, int);
 static void tputc(Term *, Rune);
+static void tputglyph(Term *, Rune);
+static int tputascii(Term *, const char *, int);
+static int tputcsi(Term *, const char *, int);
+static int tputstr(Term *, const char *, int);
 static void treset(Term *);
 static void tscrollup(Term *, int, int);
+static ushort tintern(Term *, Style);
+static void tstylegc(Term *);
+static void hpush(Term *, Line);
+static void hcompress(Term *, HistLine *);
+static void hfree(History *, Line);
+static int hspill(Term *);
+static void hspilldrop(History *);
+static void hspillreset(History *);
+static void hclear(Term *);
 static void tscrolldown(Term *, int, int);
 static void tsetattr(Term *, int *, int);
+static int tsgrattr(Glyph *, Style *, int);
+static int tsgr(Term *);
 static void tsetchar(Term *, Rune, Glyph *, int, int);
 static void tsetdirt(Term *, int, int);
+static void tdamage(Term *, int, int, int);
 static void tsetscroll(Term *, int, int);
 static void tswapscreen(Term *);
 static void tsetmode(Term *, int, int, int *, int);
+static int tgetmode(Term *, int, int);
 static int twrite(Term *, const char *, int, int);
 static void tcontrolcode(Term *, uchar );
 static void tdectest(Term *, char );
 static void tdefutf8(Term *, char);
-static int32_t tdefcolor(Term *, int *, int *, int);
+static int tdefcolor(Term *, int *, int *, int, uint32_t *);
 static void tdeftran(Term *, char);
 static void tstrsequence(Term *, uchar);
 
 static void selnormalize(Term *);
+static int selectedrange(Term *, int, int, int);
 static void selscroll(Term *, int, int);
 static void selsnap(Term *, int *, int *, int);
 
@@ -96,6 +138,8 @@ static size_t utf8decode(const char *, Rune *, size_t);
 static Rune utf8decodebyte(char, size_t *);
 static char utf8encodebyte(Rune, size_t);
 static size_t utf8validate(Rune *, size_t);
+static size_t utf8printable(const char *, size_t);
+static size_t utf8decoderun(const char *, size_t, Rune *, size_t *);
 
 static char *base64dec(const char *);
 static char base64dec_getc(const char **);
@@ -107,6 +151,143 @@ static uchar utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static Rune utfmin[UTF_SIZ + 1] = {       0,    0,  0x80,  0x800,  0x10000};
 static Rune utfmax[UTF_SIZ + 1] = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
 
+/*
+ * The escape sequence parser is a table driven state machine. Runes, and
+ * bytes as long as they are not part of a UTF-8 sequence, are mapped to a
+ * class by vtclass. vtstates[state][class] then gives the action to take
+ * and the next state, see tputc() and twrite().
+ */
+enum vtclass {
+    VC_EXEC,    /* C0 controls and DEL */
+    VC_END,     /* controls ending a string sequence: BEL, CAN, SUB, C1 */
+    VC_ESC,
+    VC_STRC1,   /* C1 controls starting a string sequence */
+    VC_COLLECT, /* parameter and intermediate bytes */
+    VC_FINAL,
+    VC_CSI,     /* ESC [ */
+    VC_STR,     /* ESC P, _, ^, ], k */
+    VC_TEST,    /* ESC # */
+    VC_UTF8,    /* ESC % */
+    VC_CHARSET, /* ESC (, ), *, + */
+    VC_HIGH,    /* printable non-ASCII */
+    VC_MB,      /* byte of a UTF-8 sequence, decoded first */
+    VC_LAST,
+};
+
+enum vtaction {
+    VA_PRINT,
+    VA_EXEC,    /* tcontrolcode() */
+    VA_STREND,  /* end the string sequence, then execute the control */
+    VA_ESC,     /* eschandle() */
+    VA_COLLECT, /* append to the CSI sequence */
+    VA_CSI,     /* append the final byte and dispatch the CSI sequence */
+    VA_PUT,     /* append to the string sequence */
+    VA_CHARSET, /* tdeftran() */
+    VA_TEST,    /* tdectest() */
+    VA_UTF8,    /* tdefutf8() */
+    VA_DECODE,  /* decode the UTF-8 sequence, then look up the rune */
+};
+
+#define VT(a, s)        ((s) << 4 | (a))
+#define VTACTION(t)     ((t) & 0xf)
+#define VTSTATE(t)      ((t) >> 4)
+#define VTBYTECLASS(c, utf8)    ((utf8) && (c) >= 0x80 ? VC_MB : vtclass[c])
+
+static const uchar vtclass[256] = {
+    [0x00 ... 0x1f] = VC_EXEC,
+    ['\a'] = VC_END, [030] = VC_END, [032] = VC_END,
+    [033] = VC_ESC,
+    [0x20 ... 0x3f] = VC_COLLECT,
+    ['#'] = VC_TEST,
+    ['%'] = VC_UTF8,
+    ['('] = VC_CHARSET, [')'] = VC_CHARSET,
+    ['*'] = VC_CHARSET, ['+'] = VC_CHARSET,
+    [0x40 ... 0x7e] = VC_FINAL,
+    ['['] = VC_CSI,
+    ['P'] = VC_STR, ['_'] = VC_STR, ['^'] = VC_STR, [']'] = VC_STR,
+    ['k'] = VC_STR,
+    [0x7f] = VC_EXEC,
+    [0x80 ... 0x9f] = VC_END,
+    [0x90] = VC_STRC1, [0x9d ... 0x9f] = VC_STRC1,
+    [0xa0 ... 0xff] = VC_HIGH,
+};
+
+/*
+ * Control codes are executed as soon as they arrive in every state but a
+ * string sequence, because they can be embedded inside a control sequence.
+ */
+#define VTCONTROLS(s) \
+    [VC_EXEC]  = VT(VA_EXEC, s), \
+    [VC_END]   = VT(VA_EXEC, s), \
+    [VC_ESC]   = VT(VA_EXEC, ESC_START), \
+    [VC_STRC1] = VT(VA_EXEC, ESC_STR), \
+    [VC_MB]    = VT(VA_DECODE, s)
+
+static const uchar vtstates[ESC_NSTATES][VC_LAST] = {
+    [ESC_GROUND] = {
+        VTCONTROLS(ESC_GROUND),
+        [VC_COLLECT ... VC_HIGH] = VT(VA_PRINT, ESC_GROUND),
+    },
+    [ESC_START] = {
+        VTCONTROLS(ESC_START),
+        [VC_COLLECT ... VC_HIGH] = VT(VA_ESC, ESC_GROUND),
+        [VC_CSI]     = VT(VA_ESC, ESC_CSI),
+        [VC_STR]     = VT(VA_ESC, ESC_STR),
+        [VC_TEST]    = VT(VA_ESC, ESC_TEST),
+        [VC_UTF8]    = VT(VA_ESC, ESC_UTF8),
+        [VC_CHARSET] = VT(VA_ESC, ESC_ALTCHARSET),
+    },
+    [ESC_CSI] = {
+        VTCONTROLS(ESC_CSI),
+        [VC_COLLECT ... VC_HIGH] = VT(VA_COLLECT, ESC_CSI),
+        [VC_FINAL]   = VT(VA_CSI, ESC_GROUND),
+        [VC_CSI]     = VT(VA_CSI, ESC_GROUND),
+        [VC_STR]     = VT(VA_CSI, ESC_GROUND),
+    },
+    [ESC_STR] = {
+        /* everything up to a terminator is payload */
+        [VC_EXEC]    = VT(VA_PUT, ESC_STR),
+        [VC_END]     = VT(VA_STREND, ESC_GROUND),
+        [VC_ESC]     = VT(VA_STREND, ESC_START),
+        [VC_STRC1]   = VT(VA_STREND, ESC_STR),
+        [VC_COLLECT ... VC_HIGH] = VT(VA_PUT, ESC_STR),
+        [VC_MB]      = VT(VA_DECODE, ESC_STR),
+    },
+    [ESC_ALTCHARSET] = {
+        VTCONTROLS(ESC_ALTCHARSET),
+        [VC_COLLECT ... VC_HIGH] = VT(VA_CHARSET, ESC_GROUND),
+    },
+    [ESC_TEST] = {
+        VTCONTROLS(ESC_TEST),
+        [VC_COLLECT ... VC_HIGH] = VT(VA_TEST, ESC_GROUND),
+    },
+    [ESC_UTF8] = {
+        VTCONTROLS(ESC_UTF8),
+        [VC_COLLECT ... VC_HIGH] = VT(VA_UTF8, ESC_GROUND),
+    },
+};
+
+typedef vec_t(Term *) vec_term_t;
+
+/*
+ * pty reading yields to keyboard input once the time slice is over. A slice
+ * begins with the first read after st_slice_begin(), not when the main loop
+ * goes to wait for events.
+ */
+static long long slice_end = LLONG_MAX;
+static int slice_armed = 0;
+static vec_term_t deferred = NULL_VEC;
+static int ptys_open = 0;
+/* scratch space for compressing history lines */
+static uchar *hzbuf;
+static size_t hzbufsiz;
+/* the history line last expanded by thist(), and the colors of its glyphs */
+static Line histbuf;
+static int histbufsiz;
+static vec_style_t histstyles = NULL_VEC;
+/* set once tintern() ran out of styles */
+static int stylesfull = 0;
+
 ssize_t
 xwrite(int fd, const char *s, size_t len)
 {
@@ -179,6 +360,90 @@ utf8decode(const char *c, Rune *u, size_t clen)
     return len;
 }
 
+/*
+ * Returns the length of the run of printable ASCII at the start of s,
+ * checking 32 or 16 bytes at a time where the CPU allows.
+ */
+size_t
+utf8printable(const char *s, size_t n)
+{
+    size_t i = 0;
+    unsigned int mask;
+
+#if defined(__AVX2__)
+    const __m256i lo32 = _mm256_set1_epi8(0x1f), hi32 = _mm256_set1_epi8(0x7f);
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        /* signed compares, so bytes >= 0x80 fail the first one */
+        mask = _mm256_movemask_epi8(_mm256_and_si256(
+                    _mm256_cmpgt_epi8(v, lo32), _mm256_cmpgt_epi8(hi32, v)));
+        if (mask != 0xffffffff)
+            return i + __builtin_ctz(~mask);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        mask = _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi)));
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+#endif
+    for (; i < n; i++) {
+        if (!BETWEEN((uchar)s[i], 0x20, 0x7e))
+            break;
+    }
+    return i;
+}
+
+/*
+ * Decode the run of non-ASCII sequences at the start of s into at most *nu
+ * runes, stopping at an ASCII byte or an incomplete sequence at the end.
+ * Invalid sequences decode to UTF_INVALID exactly as with utf8decode().
+ * Stores the number of runes in *nu and returns the bytes consumed.
+ */
+size_t
+utf8decoderun(const char *s, size_t n, Rune *u, size_t *nu)
+{
+    size_t i = 0, j, k = 0, len;
+    uchar c;
+    Rune r;
+
+    while (i < n && k < *nu) {
+        c = s[i];
+        if (c < 0x80)
+            break;
+        if (c < 0xC0 || c >= 0xF8) {
+            /* stray continuation byte, or no valid length */
+            u[k++] = UTF_INVALID;
+            i++;
+            continue;
+        }
+        len = c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+        r = c & (0x7f >> len);
+        for (j = 1; j < len && i + j < n; j++) {
+            c = s[i + j];
+            if ((c & 0xC0) != 0x80)
+                break;
+            r = (r << 6) | (c & 0x3f);
+        }
+        if (j < len) {
+            if (i + j == n)
+                break; /* incomplete, wait for the rest */
+            u[k++] = UTF_INVALID;
+            i += j;
+            continue;
+        }
+        utf8validate(&r, len);
+        u[k++] = r;
+        i += len;
+    }
+    *nu = k;
+    return i;
+}
+
 Rune
 utf8decodebyte(char c, size_t *i)
 {
@@ -390,6 +655,22 @@ selected(Term *term, int x, int y)
         && (y != term->sel.ne.y || x <= term->sel.ne.x);
 }
 
+/* Returns whether any cell from x1 to x2 on line y is selected */
+int
+selectedrange(Term *term, int x1, int x2, int y)
+{
+    if (term->sel.mode == SEL_EMPTY || term->sel.ob.x == -1 ||
+            term->sel.alt != IS_SET(MODE_ALTSCREEN) ||
+            !BETWEEN(y, term->sel.nb.y, term->sel.ne.y))
+        return 0;
+
+    if (term->sel.type == SEL_RECTANGULAR || y == term->sel.nb.y)
+        x1 = MAX(x1, term->sel.nb.x);
+    if (term->sel.type == SEL_RECTANGULAR || y == term->sel.ne.y)
+        x2 = MIN(x2, term->sel.ne.x);
+    return x1 <= x2;
+}
+
 void
 selsnap(Term *term, int *x, int *y, int direction)
 {
@@ -611,27 +892,85 @@ st_set_child_status(Term *term, int status) {
     }
 }
 
+static ssize_t
+ttyflush(Term *t)
+{
+    int n = t->wbuf.length - t->wbuf_offs;
+    ssize_t r = write_buf(t, t->wbuf.data + t->wbuf_offs, n);
+
+    if (r < 0) return r;
+    if (r == n) {
+        t->wbuf.length = 0;
+        t->wbuf_offs = 0;
+        /* all caught up, stop waking up for POLLOUT */
+        ttysetevents(t);
+    } else {
+        t->wbuf_offs += r;
+    }
+    return r;
+}
+
+/*
+ * Poller callback for a pty read by the pty reader thread, which is only
+ * polled while there is buffered output to write.
+ */
+static void
+st_on_pollout(int fd, void *data, int events)
+{
+    Term *t = data;
+
+    if ((events & POLLOUT) && t->wbuf.length)
+        ttyflush(t);
+    /* the reader thread reports the hangup, just stop polling */
+    if ((events & (POLLHUP | POLLERR)) && t->pollout) {
+        poller_del(fd);
+        t->pollout = 0;
+    }
+}
+
 void
 st_on_poll(int fd, void *data, int events) {
     Term *t = data;
     ssize_t r = 0;
+    int eof;
     if (events & POLLIN) {
         r = term_read(t);
-        if (r < 0) return;
+        /* a read cut short by the time slice is continued later, output and
+         * hangups still need handling now */
+        if (r < 0 && !t->deferred) return;
+        /* a synchronized update is drawn once it ends, only run frames
+         * to refill the read budget until then */
+        if (r > 0 && (!st_syncing(t) || t->rbudget <= 0))
+            frame_damage();
     }
     if ((events & POLLOUT) && t->wbuf.length) {
-        int n = t->wbuf.length - t->wbuf_offs;
-        r = write_buf(t, t->wbuf.data + t->wbuf_offs, n);
-        if (r < 0) return;
-        if (r == n) {
-            t->wbuf.length = 0;
-            t->wbuf_offs = 0;
-        } else {
-            t->wbuf_offs += r;
-        }
+        if (ttyflush(t) < 0) return;
     }
-    if ((events & POLLHUP) && !r) {
+    /* when out of budget or time there may still be output left to read */
+    if (t->reader)
+        eof = ptyreader_eof(t->reader);
+    else
+        eof = !r && t->rbudget > 0 && !t->deferred;
+    if ((events & POLLHUP) && !eof && !t->reader && !t->hup
+            && (t->rbudget <= 0 || t->deferred)) {
+        /*
+         * epoll keeps reporting the hangup even without POLLIN, stop
+         * polling until st_reset_budget() or st_run_deferred() go on
+         */
+        poller_del(t->cmdfd);
+        t->hup = 1;
+    }
+    if ((events & POLLHUP) && eof) {
         if (t->cmdfd != -1) {
+            ptys_open--;
+            if ((!t->reader && !t->hup) || t->pollout)
+                poller_del(t->cmdfd);
+            t->hup = 0;
+            t->pollout = 0;
+            if (t->reader) {
+                ptyreader_del(t->reader);
+                t->reader = NULL;
+            }
             close(t->cmdfd);
             t->cmdfd = -1;
         }
@@ -643,6 +982,7 @@ st_on_poll(int fd, void *data, int events) {
             fprintf(stderr, "pty HUP with %d bytes unwritten\n", t->wbuf.length);
         }
         vec_deinit(&t->wbuf);
+        frame_damage();
     }
 }
 
@@ -706,7 +1046,8 @@ ttynew(Term *term, char *line, char *cmd, char *out, char **args)
         return -1;
     }
     int flags = fcntl(m, F_GETFL, 0);
-    if (fcntl(m, F_SETFL, flags | O_CLOEXEC) < 0) {
+    if (fcntl(m, F_SETFL, flags | O_NONBLOCK) < 0 ||
+        fcntl(m, F_SETFD, FD_CLOEXEC) < 0) {
         perror("fcntl failed to set pty flags\n");
     }
 
@@ -740,9 +1081,8 @@ ttynew(Term *term, char *line, char *cmd, char *out, char **args)
             die("pledge\n");
 #endif
         close(s);
-        term->cmdfd = m;
+        st_attach_pty(term, m);
         ttyresize(term, term->col, term->row);
-        poller_add(m, term, st_on_poll);
         break;
     }
     return term->cmdfd;
@@ -758,7 +1098,8 @@ int st_fork_pty(Term *term) {
     }
     assert(m > 2 && s > 2); // Guard against std fds being accidentally closed
     int flags = fcntl(m, F_GETFL, 0);
-    if (fcntl(m, F_SETFL, flags | O_CLOEXEC) < 0) {
+    if (fcntl(m, F_SETFL, flags | O_NONBLOCK) < 0 ||
+        fcntl(m, F_SETFD, FD_CLOEXEC) < 0) {
         st_perror(term, "tersh: fcntl failed to set pty flags");
     }
 
@@ -794,47 +1135,229 @@ int st_fork_pty(Term *term) {
     default:
         // parent
         close(s);
-        term->cmdfd = m;
+        st_attach_pty(term, m);
         ttyresize(term, term->col, term->row);
-        poller_add(m, term, st_on_poll);
         break;
     }
     return term->pid;
 }
 
 
-size_t
-term_read(Term *term)
+/*
+ * Start reading the pty master fd as the Term's child pty, on the pty reader
+ * thread if enabled, otherwise from the poller.
+ */
+int
+st_attach_pty(Term *term, int fd)
 {
-    static char buf[BUFSIZ];
-    static int buflen = 0;
-    int ret, written;
+    term->cmdfd = fd;
+    ptys_open++;
+    if (readthread) {
+        if (ptyreader_start(st_on_poll) == 0)
+            term->reader = ptyreader_add(fd, term, backlogmax);
+        if (!term->reader) {
+            fprintf(stderr, "tersh: pty reader unavailable, reading ptys from the main thread\n");
+            readthread = 0;
+        }
+    }
+    if (term->reader)
+        return 0;
+    return poller_add(fd, term, st_on_poll);
+}
 
-    /* append read bytes to unprocessed bytes */
-    ret = read(term->cmdfd, buf+buflen, LEN(buf)-buflen);
+/*
+ * Read the next pty output into buf, either from the pty or from the
+ * Term's pty reader ring. Returns like read().
+ */
+static ssize_t
+ttyread(Term *term, char *buf, size_t n)
+{
+    size_t r;
 
-    switch (ret) {
-    case 0:
-        return 0;
-    case -1:
-        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) return -1;
-        die("couldn't read from shell: %s\n", strerror(errno));
+    if (!term->reader)
+        return read(term->cmdfd, buf, n);
+    r = ptyreader_read(term->reader, buf, n);
+    if (r == 0 && !ptyreader_eof(term->reader)) {
+        errno = EAGAIN;
         return -1;
-    default:
-        buflen += ret;
-        written = twrite(term, buf, buflen, 0);
-        buflen -= written;
+    }
+    return r;
+}
+
+/*
+ * Read and process pty output until the read would block, or the Term's
+ * read budget for this frame is used up. Returns the number of bytes read,
+ * 0 at EOF or -1 if nothing could be read.
+ */
+ssize_t
+term_read(Term *term)
+{
+    ssize_t ret, total = 0;
+    int written;
+
+    if (!term->rbuf)
+        term->rbuf = xmalloc(READ_BUF_SIZ);
+
+    if (slice_armed) {
+        slice_armed = 0;
+        slice_end = frame_millis() + ptyslice;
+    }
+    while (term->rbudget > 0) {
+        if (frame_millis() >= slice_end) {
+            /* out of time, let the main loop check for input first */
+            ttydefer(term);
+            return total ? total : -1;
+        }
+        /* append read bytes to unprocessed bytes */
+        ret = ttyread(term, term->rbuf + term->rbuflen,
+                MIN(READ_BUF_SIZ - term->rbuflen, term->rbudget));
+
+        if (ret == 0 || (ret < 0 && errno == EIO)) {
+            /* EOF, linux reports EIO once the slave side is closed */
+            return total;
+        } else if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+                return total ? total : -1;
+            die("couldn't read from shell: %s\n", strerror(errno));
+            return -1;
+        }
+
+        total += ret;
+        term->rbudget -= ret;
+        term->rbuflen += ret;
+        written = twrite(term, term->rbuf, term->rbuflen, 0);
+        term->rbuflen -= written;
         /* keep any incomplete UTF-8 byte sequence for the next call */
-        if (buflen > 0)
-            memmove(buf, buf + written, buflen);
-        return ret;
+        if (term->rbuflen > 0)
+            memmove(term->rbuf, term->rbuf + written, term->rbuflen);
+    }
+
+    /* out of budget, stop polling for input until the next frame */
+    ttysetevents(term);
+    return total;
+}
+
+void
+st_reset_budget(Term *term)
+{
+    int spent = term->rbudget <= 0;
+    int throttled, events;
+
+    /*
+     * The job is throttled while its pty is not being read: by the reader
+     * thread once the backlog hit backlogmax, or without it for the rest of
+     * a frame once the read budget is used up.
+     */
+    throttled = term->reader ? ptyreader_paused(term->reader) : spent;
+    term->rbudget = readbudget;
+    if (throttled != term->throttled) {
+        /* show or hide the job's throttle indicator */
+        term->throttled = throttled;
+        frame_damage();
+    }
+    if (term->hup) {
+        /* the pty isn't polled anymore, read the rest of it from here */
+        st_on_poll(term->cmdfd, term, POLLIN | POLLHUP);
+        return;
+    }
+    if (!spent)
+        return;
+    if (!term->reader) {
+        ttysetevents(term);
+        return;
+    }
+    /* the reader thread won't wake us again if it's waiting on us */
+    events = ptyreader_events(term->reader);
+    if (events)
+        st_on_poll(term->cmdfd, term, events);
+}
+
+/*
+ * Returns non-zero while the application is in the middle of a synchronized
+ * update, and what is on screen should be left as it is.
+ */
+int
+st_syncing(Term *term)
+{
+    return IS_SET(MODE_SYNC) &&
+        frame_millis() - term->syncstart < synctimeout;
+}
+
+/*
+ * Start a new time slice for processing pty output, from the next pty read
+ * on, which lasts until st_slice_end().
+ */
+void
+st_slice_begin(void)
+{
+    slice_armed = 1;
+    slice_end = LLONG_MAX;
+}
+
+/*
+ * Process pty output without a time limit again, like while drawing.
+ */
+void
+st_slice_end(void)
+{
+    slice_armed = 0;
+    slice_end = LLONG_MAX;
+}
+
+static void
+ttydefer(Term *term)
+{
+    if (term->deferred)
+        return;
+    term->deferred = 1;
+    vec_push(&deferred, term);
+}
+
+/*
+ * Continue reading the Terms whose reading ran out of time slice. Returns
+ * the number of Terms still deferred after that.
+ */
+int
+st_run_deferred(void)
+{
+    static vec_term_t run = NULL_VEC;
+    Term *term;
+    int i, events;
+
+    if (!deferred.length)
+        return 0;
+    vec_clear(&run);
+    vec_extend(&run, &deferred);
+    vec_clear(&deferred);
+    vec_foreach(&run, term, i) {
+        term->deferred = 0;
+        if (term->cmdfd < 0)
+            continue;
+        if (term->reader)
+            events = ptyreader_events(term->reader);
+        else
+            events = term->hup ? POLLIN | POLLHUP : POLLIN;
+        if (events)
+            st_on_poll(term->cmdfd, term, events);
     }
+    return deferred.length;
+}
+
+/*
+ * Returns the number of ptys attached to Terms that are still open.
+ */
+int
+st_ptys_open(void)
+{
+    return ptys_open;
 }
 
 void
 ttywrite(Term *term, const char *s, size_t n, int may_echo)
 {
+    struct iovec iov[TTYWRITE_IOV];
     const char *next;
+    int cnt = 0;
 
     if (may_echo && IS_SET(MODE_ECHO))
         twrite(term, s, n, 1);
@@ -844,19 +1367,30 @@ ttywrite(Term *term, const char *s, size_t n, int may_echo)
         return;
     }
 
-    /* This is similar to how the kernel handles ONLCR for ttys */
+    /*
+     * This is similar to how the kernel handles ONLCR for ttys. The
+     * translated segments go out together with one writev().
+     */
     while (n > 0) {
         if (*s == '\r') {
             next = s + 1;
-            ttywriteraw(term, "\r\n", 2);
+            iov[cnt].iov_base = "\r\n";
+            iov[cnt].iov_len = 2;
         } else {
             next = memchr(s, '\r', n);
             DEFAULT(next, s + n);
-            ttywriteraw(term, s, next - s);
+            iov[cnt].iov_base = (char *)s;
+            iov[cnt].iov_len = next - s;
+        }
+        if (++cnt == TTYWRITE_IOV) {
+            ttywritev(term, iov, cnt);
+            cnt = 0;
         }
         n -= next - s;
         s = next;
     }
+    if (cnt)
+        ttywritev(term, iov, cnt);
 }
 
 static ssize_t
@@ -896,30 +1430,81 @@ write_buf(Term *term, const char *s, size_t n)
 static void
 ttywriteraw(Term *term, const char *s, size_t n)
 {
-    ssize_t r;
+    struct iovec iov = { .iov_base = (char *)s, .iov_len = n };
+
+    ttywritev(term, &iov, 1);
+}
 
-    if (term->wbuf.length) {
-        /* Already buffering, just append and exit */
-        vec_pusharr(&term->wbuf, s, n);
+/*
+ * Write all segments with a single writev(), and buffer whatever the pty
+ * didn't take to be written out when it is ready for more. Large writes
+ * such as pastes are that way streamed through the write buffer instead of
+ * blocking.
+ */
+static void
+ttywritev(Term *term, struct iovec *iov, int cnt)
+{
+    ssize_t r = 0;
+    int buffering = term->wbuf.length;
+    int i;
+
+    if (term->cmdfd < 0)
         return;
+
+    /* Already buffering, just append and keep the order */
+    if (!buffering) {
+        r = writev(term->cmdfd, iov, cnt);
+        if (r < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("error writing to pty");
+                return;
+            }
+            r = 0;
+        }
     }
 
-    /*
-     * Attempt to write immediately.
-     *
-     * Only write the bytes written by ttywrite(term) or the
-     * default of 256. This seems to be a reasonable value
-     * for a serial line. Bigger values might clog the I/O.
-     */
-    r = write_buf(term, s, n);
-    if (r < 0) {
-        return;
+    /* We weren't able to write out everything, buffer the rest */
+    for (i = 0; i < cnt; i++) {
+        if ((size_t)r >= iov[i].iov_len) {
+            r -= iov[i].iov_len;
+            continue;
+        }
+        vec_pusharr(&term->wbuf, (char *)iov[i].iov_base + r,
+                iov[i].iov_len - r);
+        r = 0;
     }
+    if (!buffering && term->wbuf.length)
+        ttysetevents(term);
+}
+
+/*
+ * Only poll for input while there is read budget left, and for output
+ * while there are buffered bytes to write.
+ */
+static void
+ttysetevents(Term *term)
+{
+    int events = 0;
 
-    if (r < n) {
-        /* We weren't able to write out everything, buffer the rest */
-        vec_pusharr(&term->wbuf, s + r, n - r);
+    if (term->cmdfd < 0 || term->hup)
+        return;
+    if (term->reader) {
+        /* reading is up to the reader thread, only poll for POLLOUT */
+        events = term->wbuf.length > term->wbuf_offs;
+        if (events && !term->pollout) {
+            poller_add(term->cmdfd, term, st_on_pollout);
+            poller_set_events(term->cmdfd, POLLOUT);
+        } else if (!events && term->pollout) {
+            poller_del(term->cmdfd);
+        }
+        term->pollout = events;
+        return;
     }
+    if (term->rbudget > 0)
+        events |= POLLIN;
+    if (term->wbuf.length > term->wbuf_offs)
+        events |= POLLOUT;
+    poller_set_events(term->cmdfd, events);
 }
 
 void
@@ -942,16 +1527,31 @@ ttyhangup(Term *term)
     kill(term->pid, SIGHUP);
 }
 
+/*
+ * Returns the attributes used on line y and makes them its summary again.
+ * The summary in term->lineattr is only added to as glyphs are written, so
+ * it may still hold attributes which were overwritten since.
+ */
+int
+tlineattr(Term *term, int y)
+{
+    int x;
+    ushort attr = 0;
+
+    for (x = 0; x < term->col; x++)
+        attr |= term->line[y][x].mode;
+    term->lineattr[y] = attr;
+    return attr;
+}
+
 int
 tattrset(Term *term, int attr)
 {
-    int i, j;
+    int i;
 
-    for (i = 0; i < term->row-1; i++) {
-        for (j = 0; j < term->col-1; j++) {
-            if (term->line[i][j].mode & attr)
-                return 1;
-        }
+    for (i = 0; i < term->row; i++) {
+        if ((term->lineattr[i] & attr) && (tlineattr(term, i) & attr))
+            return 1;
     }
 
     return 0;
@@ -966,21 +1566,34 @@ tsetdirt(Term *term, int top, int bot)
     LIMIT(bot, 0, term->row-1);
 
     for (i = top; i <= bot; i++)
-        term->dirty[i] = 1;
+        tdamage(term, i, 0, term->col-1);
+}
+
+/* Add columns x1 to x2 of line y to what needs drawing */
+void
+tdamage(Term *term, int y, int x1, int x2)
+{
+    LineDamage *d = &term->dirty[y];
+
+    LIMIT(x1, 0, term->col-1);
+    LIMIT(x2, 0, term->col-1);
+    if (d->x1 > d->x2) {
+        d->x1 = x1;
+        d->x2 = x2;
+    } else {
+        d->x1 = MIN(d->x1, x1);
+        d->x2 = MAX(d->x2, x2);
+    }
 }
 
 void
 tsetdirtattr(Term *term, int attr)
 {
-    int i, j;
+    int i;
 
-    for (i = 0; i < term->row-1; i++) {
-        for (j = 0; j < term->col-1; j++) {
-            if (term->line[i][j].mode & attr) {
-                tsetdirt(term, i, i);
-                break;
-            }
-        }
+    for (i = 0; i < term->row; i++) {
+        if ((term->lineattr[i] & attr) && (tlineattr(term, i) & attr))
+            tsetdirt(term, i, i);
     }
 }
 
@@ -993,7 +1606,7 @@ tfulldirt(Term *term)
 void
 tcursor(Term *term, int mode)
 {
-    static TCursor c[2];
+    TCursor *c = term->saved;
     int alt = IS_SET(MODE_ALTSCREEN);
 
     if (mode == CURSOR_SAVE) {
@@ -1004,6 +1617,139 @@ tcursor(Term *term, int mode)
     }
 }
 
+static uint
+stylehash(Style st)
+{
+    uint h = st.fg * 0x9E3779B1u ^ st.bg * 0x85EBCA77u;
+
+    return h ^ (h >> 15);
+}
+
+/* Add style id to the hash table, which must have room for it */
+static void
+tstyleadd(Term *term, int id)
+{
+    uint i, mask = term->stylehashsiz - 1;
+
+    for (i = stylehash(term->styles.data[id]) & mask; term->stylehash[i];
+            i = (i + 1) & mask)
+        ;
+    term->stylehash[i] = id + 1;
+}
+
+/*
+ * Returns the index of colors st in the Term's styles, adding them if they
+ * are new. When all STYLE_MAX styles are taken, the ones no glyph uses
+ * anymore are reused, or else the default colors are returned.
+ */
+ushort
+tintern(Term *term, Style st)
+{
+    History *h = &term->hist;
+    HistLine *hl;
+    Style *s;
+    int *old, oldsiz, id, i;
+    uint mask;
+
+    if (term->stylehashsiz) {
+        mask = term->stylehashsiz - 1;
+        for (i = stylehash(st) & mask; (id = term->stylehash[i]);
+                i = (i + 1) & mask) {
+            s = &term->styles.data[id - 1];
+            if (s->fg == st.fg && s->bg == st.bg)
+                return id - 1;
+        }
+    }
+
+    if (!term->freestyles.length && term->styles.length == STYLE_MAX) {
+        tstylegc(term);
+        if (term->freestyles.length < STYLE_MAX / 16) {
+            /* the hot history lines hold on to too many, compress them */
+            for (i = 0; i < h->n; i++) {
+                hl = &h->line[(h->head + i) % h->size];
+                if (hl->line) {
+                    hcompress(term, hl);
+                    hfree(h, hl->line);
+                    hl->line = NULL;
+                }
+            }
+            tstylegc(term);
+        }
+        if (!term->freestyles.length) {
+            /* only the screens can take them all, say so once */
+            if (!stylesfull++)
+                fprintf(stderr, "tersh: more than %d colors on screen, "
+                        "drawing the rest in the default ones\n",
+                        STYLE_MAX);
+            return 0;
+        }
+    }
+    if (term->freestyles.length) {
+        id = vec_pop(&term->freestyles);
+        term->styles.data[id] = st;
+    } else {
+        vec_push(&term->styles, st);
+        id = term->styles.length - 1;
+    }
+
+    if ((term->styles.length - term->freestyles.length) * 2
+            > term->stylehashsiz) {
+        /* keep the table at most half full */
+        old = term->stylehash;
+        oldsiz = term->stylehashsiz;
+        term->stylehashsiz = MAX(oldsiz * 2, 16);
+        term->stylehash = xmalloc(term->stylehashsiz * sizeof(int));
+        memset(term->stylehash, 0, term->stylehashsiz * sizeof(int));
+        for (i = 0; i < oldsiz; i++) {
+            if (old[i])
+                tstyleadd(term, old[i] - 1);
+        }
+        free(old);
+    }
+    tstyleadd(term, id);
+    return id;
+}
+
+/*
+ * Free the styles no glyph uses anymore. History lines that are compressed
+ * keep their colors instead, so only the screens, the lines in the history
+ * ring and the cursors need to be looked at.
+ */
+void
+tstylegc(Term *term)
+{
+    static uchar used[STYLE_MAX];
+    History *h = &term->hist;
+    HistLine *hl;
+    int x, y, i;
+
+    memset(used, 0, sizeof(used));
+    used[0] = 1;
+    used[term->c.attr.style] = 1;
+    used[term->saved[0].attr.style] = 1;
+    used[term->saved[1].attr.style] = 1;
+    for (y = 0; y < term->row; y++) {
+        for (x = 0; x < term->col; x++) {
+            used[term->line[y][x].style] = 1;
+            used[term->alt[y][x].style] = 1;
+        }
+    }
+    for (i = 0; i < h->n; i++) {
+        hl = &h->line[(h->head + i) % h->size];
+        for (x = 0; hl->line && x < hl->len; x++)
+            used[hl->line[x].style] = 1;
+    }
+
+    vec_clear(&term->freestyles);
+    memset(term->stylehash, 0, term->stylehashsiz * sizeof(int));
+    for (i = 0; i < term->styles.length; i++) {
+        if (used[i])
+            tstyleadd(term, i);
+        else
+            vec_push(&term->freestyles, i);
+    }
+}
+
 void
 treset(Term *term)
 {
@@ -1011,8 +1757,7 @@ treset(Term *term)
 
     term->c = (TCursor){{
         .mode = ATTR_NULL,
-        .fg = defaultfg,
-        .bg = defaultbg
+        .style = 0 /* defaultfg and defaultbg */
     }, .x = 0, .y = 0, .state = CURSOR_DEFAULT};
 
     memset(term->tabs, 0, term->col * sizeof(*term->tabs));
@@ -1036,8 +1781,10 @@ void
 tnew(Term *term, int col, int row)
 {
     memset(term, 0, sizeof(Term));
-    term->c.attr.fg = defaultfg;
-    term->c.attr.bg = defaultbg;
+    term->hist.spillfd = -1;
+    term->rbudget = readbudget;
+    /* style 0 */
+    tintern(term, (Style){ .fg = defaultfg, .bg = defaultbg });
     term->cursorshape = cursorshape;
     tresize(term, col, row);
     treset(term);
@@ -1047,9 +1794,12 @@ void
 tswapscreen(Term *term)
 {
     Line *tmp = term->line;
+    ushort *tmpattr = term->lineattr;
 
     term->line = term->alt;
     term->alt = tmp;
+    term->lineattr = term->altattr;
+    term->altattr = tmpattr;
     term->mode ^= MODE_ALTSCREEN;
     tfulldirt(term);
 }
@@ -1059,6 +1809,7 @@ tscrolldown(Term *term, int orig, int n)
 {
     int i;
     Line temp;
+    ushort tempattr;
 
     LIMIT(n, 0, term->bot-orig+1);
 
@@ -1069,6 +1820,10 @@ tscrolldown(Term *term, int orig, int n)
         temp = term->line[i];
         term->line[i] = term->line[i-n];
         term->line[i-n] = temp;
+        tempattr = term->lineattr[i];
+        term->lineattr[i] = term->lineattr[i-n];
+        term->lineattr[i-n] = tempattr;
+        term->dirty[i].scrolled = 1;
     }
 
     selscroll(term, orig, n);
@@ -1079,9 +1834,15 @@ tscrollup(Term *term, int orig, int n)
 {
     int i;
     Line temp;
+    ushort tempattr;
 
     LIMIT(n, 0, term->bot-orig+1);
 
+    if (orig == 0 && !IS_SET(MODE_ALTSCREEN)) {
+        /* keep the lines in the history */
+        for (i = 0; i < n; i++)
+            hpush(term, term->line[i]);
+    }
     tclearregion(term, 0, orig, term->col-1, orig+n-1);
     tsetdirt(term, orig+n, term->bot);
 
@@ -1089,6 +1850,10 @@ tscrollup(Term *term, int orig, int n)
         temp = term->line[i];
         term->line[i] = term->line[i+n];
         term->line[i+n] = temp;
+        tempattr = term->lineattr[i];
+        term->lineattr[i] = term->lineattr[i+n];
+        term->lineattr[i+n] = tempattr;
+        term->dirty[i].scrolled = 1;
     }
 
     selscroll(term, orig, -n);
@@ -1114,6 +1879,477 @@ selscroll(Term *term, int orig, int n)
     }
 }
 
+/* Glyphs in a row worth storing as a repeat in compressed history */
+#define HREPMIN 4
+#define HATTRSIZ (sizeof(ushort) + 2 * sizeof(uint32_t))
+/* Memory a history line takes besides its glyphs: its ring slot and malloc's */
+#define HOVERHEAD (sizeof(HistLine) + 2 * sizeof(size_t))
+#define HSIZE(hl) (HOVERHEAD + ((hl)->line ? (hl)->len * sizeof(Glyph) \
+            : (size_t)(hl)->zlen))
+/* History lines between entries of the spill file's sparse index */
+#define HSPILLSTEP 64
+/* The spill file is mapped in steps of this many bytes */
+#define HSPILLMAP (4 << 20)
+/* Dropped lines at the start of the spill file worth writing over */
+#define HSPILLREUSE (1 << 20)
+
+/* Returns the number of glyphs from g[x] on that are the same as g[x] */
+static int
+hrunlen(Line g, int x, int len)
+{
+    int y;
+
+    for (y = x + 1; y < len && g[y].u == g[x].u && !ATTRCMP(g[y], g[x]); y++)
+        ;
+    return y - x;
+}
+
+static size_t
+hputvarint(uchar *p, uint v)
+{
+    size_t n = 0;
+
+    for (; v >= 0x80; v >>= 7)
+        p[n++] = v | 0x80;
+    p[n++] = v;
+    return n;
+}
+
+static size_t
+hgetvarint(const uchar *p, const uchar *end, uint *v)
+{
+    size_t n = 0;
+    int shift = 0;
+
+    for (*v = 0; p + n < end && shift < 32; shift += 7) {
+        *v |= (uint)(p[n] & 0x7f) << shift;
+        if (!(p[n++] & 0x80))
+            break;
+    }
+    return n;
+}
+
+/*
+ * Encode len glyphs of a history line into hzbuf, as a series of runs of
+ * glyphs with the same attributes. A run starts with a varint of its glyph
+ * count shifted left by two, with bit 1 set if it is a single glyph
+ * repeated, and bit 0 set if it has the attributes of the run before.
+ * Otherwise its mode, fg and bg follow. The colors are stored rather than
+ * the style, so the Term's styles can be reused once no glyph on screen
+ * has them. Then come the runes as UTF-8, just one for a repeat. Returns
+ * the encoded size.
+ */
+static size_t
+hencode(Term *term, Line g, int len)
+{
+    size_t n = 0, need;
+    Style *st;
+    int x, y, i, k, rep, same, prev = -1;
+
+    need = len * (5 + HATTRSIZ + UTF_SIZ);
+    if (hzbufsiz < need)
+        hzbuf = xrealloc(hzbuf, hzbufsiz = need);
+    for (x = 0; x < len; x = y) {
+        k = hrunlen(g, x, len);
+        rep = k >= HREPMIN;
+        y = x + k;
+        while (!rep && y < len && !ATTRCMP(g[y], g[x])
+                && (k = hrunlen(g, y, len)) < HREPMIN)
+            y += k;
+
+        same = prev >= 0 && !ATTRCMP(g[prev], g[x]);
+        n += hputvarint(hzbuf + n, (uint)(y - x) << 2 | rep << 1 | same);
+        if (!same) {
+            st = &term->styles.data[g[x].style];
+            memcpy(hzbuf + n, &g[x].mode, sizeof(ushort));
+            memcpy(hzbuf + n + sizeof(ushort), &st->fg, sizeof(uint32_t));
+            memcpy(hzbuf + n + sizeof(ushort) + sizeof(uint32_t), &st->bg,
+                    sizeof(uint32_t));
+            n += HATTRSIZ;
+        }
+        for (i = x; i < (rep ? x + 1 : y); i++)
+            n += utf8encode(g[i].u, (char *)hzbuf + n);
+        prev = x;
+    }
+    return n;
+}
+
+/*
+ * Compress a history line, see hencode(). Lines are compressed even when
+ * that doesn't make them smaller, so they don't hold on to their styles.
+ * The caller frees hl->line.
+ */
+void
+hcompress(Term *term, HistLine *hl)
+{
+    size_t n = hencode(term, hl->line, hl->len);
+
+    hl->z = xmalloc(n);
+    memcpy(hl->z, hzbuf, n);
+    hl->zlen = n;
+    term->hist.bytes += n;
+    term->hist.bytes -= hl->len * sizeof(Glyph);
+}
+
+/*
+ * Expand a compressed history line into g, which holds hl->len glyphs. The
+ * glyphs' styles index histstyles, one entry for each run, so drawing never
+ * changes the Term's styles.
+ */
+static void
+hexpand(HistLine *hl, Line g)
+{
+    const uchar *p = hl->z, *end = hl->z + hl->zlen;
+    Glyph a = { .u = ' ' };
+    Style st;
+    uint v;
+    int i, n, x = 0;
+
+    vec_clear(&histstyles);
+    while (p < end) {
+        p += hgetvarint(p, end, &v);
+        n = v >> 2;
+        if (!(v & 1) && end - p >= (ptrdiff_t)HATTRSIZ) {
+            memcpy(&a.mode, p, sizeof(ushort));
+            memcpy(&st.fg, p + sizeof(ushort), sizeof(uint32_t));
+            memcpy(&st.bg, p + sizeof(ushort) + sizeof(uint32_t),
+                    sizeof(uint32_t));
+            vec_push(&histstyles, st);
+            a.style = histstyles.length - 1;
+            p += HATTRSIZ;
+        }
+        for (i = 0; i < n && x < hl->len; i++) {
+            if (i == 0 || !(v & 2))
+                p += utf8decode((const char *)p, &a.u, end - p);
+            g[x++] = a;
+        }
+    }
+}
+
+/* Free a history line, keeping its memory for the next line if needed */
+void
+hfree(History *h, Line line)
+{
+    if (!h->spare)
+        h->spare = line;
+    else
+        free(line);
+}
+
+/*
+ * Copy a line of term->col glyphs that scrolled off the main screen to the
+ * history, dropping the oldest lines to stay within histlines and
+ * histbytes, and compressing the line leaving the hot window.
+ */
+void
+hpush(Term *term, Line line)
+{
+    History *h = &term->hist;
+    size_t need = term->col * sizeof(Glyph);
+    HistLine *hl, *nline;
+    int i, size;
+
+    if (!histlines || need > histbytes)
+        return;
+    while (h->n + h->nspill >= histlines
+            || h->bytes + h->spillbytes + HOVERHEAD + need > histbytes) {
+        if (h->nspill) {
+            hspilldrop(h);
+            continue;
+        }
+        hl = &h->line[h->head];
+        h->bytes -= HSIZE(hl);
+        if (hl->line)
+            hfree(h, hl->line);
+        free(hl->z);
+        h->head = (h->head + 1) % h->size;
+        h->n--;
+    }
+    if (h->n == h->size) {
+        /* grow the ring as lines come in, up to histlines slots */
+        size = MIN(MAX(h->size * 2, 64), histlines);
+        nline = xmalloc(size * sizeof(HistLine));
+        for (i = 0; i < h->n; i++)
+            nline[i] = h->line[(h->head + i) % h->size];
+        free(h->line);
+        h->line = nline;
+        h->size = size;
+        h->head = 0;
+    }
+    hl = &h->line[(h->head + h->n) % h->size];
+    *hl = (HistLine){ .line = xrealloc(h->spare, need), .len = term->col };
+    h->spare = NULL;
+    memcpy(hl->line, line, need);
+    h->n++;
+    h->bytes += HSIZE(hl);
+    h->changes++;
+    /* keep a scrolled back view on the same lines */
+    if (term->scroll)
+        term->scroll++;
+
+    if (h->n > histhot) {
+        hl = &h->line[(h->head + h->n - 1 - histhot) % h->size];
+        if (hl->line) {
+            hcompress(term, hl);
+            hfree(h, hl->line);
+            hl->line = NULL;
+        }
+    }
+    /* move the oldest lines out of memory, but keep the hot window */
+    while (histspill && h->bytes > histspill && h->n > histhot
+            && hspill(term) == 0)
+        ;
+}
+
+/*
+ * Map the whole spill file for reading. Returns 0 on success, -1 on error.
+ */
+static int
+hmap(History *h)
+{
+    size_t len;
+
+    if (h->map && h->maplen >= (size_t)h->spillsize)
+        return 0;
+    if (h->map)
+        munmap(h->map, h->maplen);
+    /* leave room to grow, so not every line appended needs a new mapping */
+    len = ((size_t)h->spillsize + HSPILLMAP) & ~(size_t)(HSPILLMAP - 1);
+    h->map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+            h->spillfd, 0);
+    if (h->map == MAP_FAILED) {
+        h->map = NULL;
+        return -1;
+    }
+    h->maplen = len;
+    return 0;
+}
+
+/* Returns the size of the spilled line at p, see hspill() */
+static size_t
+hreclen(const uchar *p, const uchar *end)
+{
+    size_t n;
+    uint len, zlen;
+
+    n = hgetvarint(p, end, &len);
+    n += hgetvarint(p + n, end, &zlen);
+    return n + zlen;
+}
+
+/* Stop spilling this History's lines until it is emptied */
+static int
+hspillerror(History *h, const char *s)
+{
+    fprintf(stderr, "tersh: scrollback spill file %s: %s\n", s,
+            errno ? strerror(errno) : "short write");
+    h->spillfailed = 1;
+    return -1;
+}
+
+/*
+ * Move the oldest line in the ring to the spill file. It is written as
+ * varints of its length and compressed size, followed by the compressed
+ * line. Lines are appended until the dropped ones at the start of the file
+ * take more room than the rest, then written from the start again, so the
+ * file is used as a ring. Returns 0 on success, -1 if the line stays in
+ * memory.
+ */
+int
+hspill(Term *term)
+{
+    History *h = &term->hist;
+    HistLine *hl = &h->line[h->head];
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    const uchar *z = hl->z;
+    uchar hdr[10];
+    size_t n, zlen = hl->zlen, size = HSIZE(hl);
+    off_t off;
+
+    if (h->spillfailed)
+        return -1;
+    if (h->spillfd < 0) {
+        snprintf(path, sizeof(path), "%s/tersh-XXXXXX",
+                dir && *dir ? dir : "/tmp");
+        if ((h->spillfd = mkostemp(path, O_CLOEXEC)) < 0)
+            return hspillerror(h, "mkostemp");
+        unlink(path);
+    }
+
+    if (hl->line) {
+        /* its glyphs' styles are only good for this Term */
+        zlen = hencode(term, hl->line, hl->len);
+        z = hzbuf;
+    }
+    n = hputvarint(hdr, hl->len);
+    n += hputvarint(hdr + n, zlen);
+    if (!h->spillwrap && h->spilloff >= HSPILLREUSE
+            && (size_t)h->spilloff >= h->spillbytes + n + zlen) {
+        h->spillwrap = h->spillend;
+        h->spillend = 0;
+    }
+    /* wait for older lines to be dropped to make room */
+    if (h->spillwrap && h->spillend + (off_t)(n + zlen) > h->spilloff)
+        return -1;
+    off = h->spillend;
+    errno = 0;
+    if (pwrite(h->spillfd, hdr, n, off) != (ssize_t)n
+            || pwrite(h->spillfd, z, zlen, off + n) != (ssize_t)zlen) {
+        hspillerror(h, "write");
+        if (off + (off_t)(n + zlen) > h->spillsize
+                && ftruncate(h->spillfd, h->spillsize) < 0)
+            hspillerror(h, "truncate");
+        return -1;
+    }
+    if ((h->spillfirst + h->nspill) % HSPILLSTEP == 0)
+        vec_push(&h->spillidx, off);
+    h->spillend += n + zlen;
+    h->spillsize = MAX(h->spillsize, h->spillend);
+    h->spillbytes += n + zlen;
+    h->nspill++;
+
+    h->bytes -= size;
+    if (hl->line)
+        hfree(h, hl->line);
+    free(hl->z);
+    h->head = (h->head + 1) % h->size;
+    h->n--;
+    return 0;
+}
+
+/* Drop the oldest line in the spill file */
+void
+hspilldrop(History *h)
+{
+    size_t len;
+    int i;
+
+    if (hmap(h) < 0) {
+        /* the lines can't be read anymore anyway */
+        hspillreset(h);
+        return;
+    }
+    len = hreclen(h->map + h->spilloff, h->map + h->spillsize);
+    h->spilloff += len;
+    h->spillbytes -= len;
+    h->spillfirst++;
+    if (--h->nspill == 0) {
+        hspillreset(h);
+        return;
+    }
+    if (h->spillwrap && h->spilloff == h->spillwrap) {
+        /* the lines before the wrap are gone, free the end of the file */
+        h->spilloff = 0;
+        h->spillwrap = 0;
+        if (ftruncate(h->spillfd, h->spillend) < 0)
+            hspillerror(h, "truncate");
+        else
+            h->spillsize = h->spillend;
+    }
+    /* forget the index entries of dropped lines once they are half of it */
+    i = h->spillfirst / HSPILLSTEP;
+    if (i > 0 && i * 2 >= h->spillidx.length) {
+        vec_splice(&h->spillidx, 0, i);
+        h->spillfirst -= i * HSPILLSTEP;
+    }
+}
+
+/* Drop all lines in the spill file */
+void
+hspillreset(History *h)
+{
+    h->spillfailed = 0;
+    if (h->spillfd >= 0 && ftruncate(h->spillfd, 0) < 0)
+        hspillerror(h, "truncate");
+    h->nspill = 0;
+    h->spillfirst = 0;
+    h->spilloff = 0;
+    h->spillend = 0;
+    h->spillwrap = 0;
+    h->spillsize = 0;
+    h->spillbytes = 0;
+    vec_clear(&h->spillidx);
+}
+
+void
+hclear(Term *term)
+{
+    History *h = &term->hist;
+
+    for (; h->n > 0; h->n--) {
+        free(h->line[h->head].line);
+        free(h->line[h->head].z);
+        h->head = (h->head + 1) % h->size;
+    }
+    h->head = 0;
+    h->bytes = 0;
+    hspillreset(h);
+    h->changes++;
+    term->scroll = 0;
+}
+
+/*
+ * Returns history line i counting back from the most recent one, its width
+ * in len, and in styles the colors its glyphs' styles index. A compressed
+ * line is expanded into buffers that are only valid until the next call.
+ */
+Line
+thist(Term *term, int i, int *len, const Style **styles)
+{
+    History *h = &term->hist;
+    HistLine *hl, spilled;
+    const uchar *p, *end;
+    uint v, zlen;
+    int k;
+
+    *styles = term->styles.data;
+    if (i < h->n) {
+        hl = &h->line[(h->head + h->n - 1 - i) % h->size];
+        if (hl->line) {
+            *len = hl->len;
+            return hl->line;
+        }
+    } else {
+        /*
+         * find the line from the nearest index entry before it, or from
+         * the oldest line, as that entry's line may be dropped already
+         */
+        *len = 0;
+        if (hmap(h) < 0)
+            return histbuf;
+        k = h->spillfirst + h->nspill - 1 - (i - h->n);
+        if (k / HSPILLSTEP == h->spillfirst / HSPILLSTEP) {
+            p = h->map + h->spilloff;
+            k -= h->spillfirst;
+        } else {
+            p = h->map + h->spillidx.data[k / HSPILLSTEP];
+            k %= HSPILLSTEP;
+        }
+        end = h->map + h->spillsize;
+        for (; k > 0; k--) {
+            p += hreclen(p, end);
+            if (h->spillwrap && p == h->map + h->spillwrap)
+                p = h->map;
+        }
+        p += hgetvarint(p, end, &v);
+        p += hgetvarint(p, end, &zlen);
+        hl = &spilled;
+        hl->len = v;
+        hl->z = (uchar *)p;
+        hl->zlen = zlen;
+    }
+
+    *len = hl->len;
+    if (histbufsiz < hl->len) {
+        histbuf = xrealloc(histbuf, hl->len * sizeof(Glyph));
+        histbufsiz = hl->len;
+    }
+    hexpand(hl, histbuf);
+    *styles = histstyles.data;
+    return histbuf;
+}
+
 void
 tnewline(Term *term, int first_col)
 {
@@ -1210,14 +2446,15 @@ tsetchar(Term *term, Rune u, Glyph *attr, int x, int y)
             term->line[y][x+1].u = ' ';
             term->line[y][x+1].mode &= ~ATTR_WDUMMY;
         }
-    } else if (term->line[y][x].mode & ATTR_WDUMMY) {
+    } else if ((term->line[y][x].mode & ATTR_WDUMMY) && x > 0) {
         term->line[y][x-1].u = ' ';
         term->line[y][x-1].mode &= ~ATTR_WIDE;
     }
 
-    term->dirty[y] = 1;
+    tdamage(term, y, x-1, x+1);
     term->line[y][x] = *attr;
     term->line[y][x].u = u;
+    term->lineattr[y] |= attr->mode;
     if (y >= term->nlines) {
         term->nlines = y + 1;
     }
@@ -1226,8 +2463,11 @@ tsetchar(Term *term, Rune u, Glyph *attr, int x, int y)
 void
 tclearregion(Term *term, int x1, int y1, int x2, int y2)
 {
-    int x, y, temp;
-    Glyph *gp;
+    int y, temp;
+    Glyph g = {
+        .u = ' ',
+        .style = term->c.attr.style,
+    };
 
     if (x1 > x2)
         temp = x1, x1 = x2, x2 = temp;
@@ -1240,19 +2480,38 @@ tclearregion(Term *term, int x1, int y1, int x2, int y2)
     LIMIT(y2, 0, term->row-1);
 
     for (y = y1; y <= y2; y++) {
-        term->dirty[y] = 1;
-        for (x = x1; x <= x2; x++) {
-            gp = &term->line[y][x];
-            if (selected(term, x, y))
-                selclear(term);
-            gp->fg = term->c.attr.fg;
-            gp->bg = term->c.attr.bg;
-            gp->mode = 0;
-            gp->u = ' ';
+        if (selectedrange(term, x1, x2, y)) {
+            selclear(term);
+            break;
+        }
+    }
+
+    /* fill the first line, then copy it to the others */
+    tfillglyph(&term->line[y1][x1], &g, x2 - x1 + 1);
+    for (y = y1; y <= y2; y++) {
+        if (y > y1) {
+            memcpy(&term->line[y][x1], &term->line[y1][x1],
+                    (x2 - x1 + 1) * sizeof(Glyph));
         }
+        tdamage(term, y, x1, x2);
+        if (x1 == 0 && x2 == term->col-1)
+            term->lineattr[y] = 0;
     }
 }
 
+/* Set n glyphs to *g, doubling the copied span each time */
+void
+tfillglyph(Glyph *gp, const Glyph *g, int n)
+{
+    int i;
+
+    if (n <= 0)
+        return;
+    gp[0] = *g;
+    for (i = 1; i < n; i *= 2)
+        memcpy(&gp[i], gp, MIN(i, n - i) * sizeof(Glyph));
+}
+
 void
 tdeletechar(Term *term, int n)
 {
@@ -1267,6 +2526,7 @@ tdeletechar(Term *term, int n)
     line = term->line[term->c.y];
 
     memmove(&line[dst], &line[src], size * sizeof(Glyph));
+    tdamage(term, term->c.y, dst, term->col-1);
     tclearregion(term, term->col-n, term->c.y, term->col-1, term->c.y);
 }
 
@@ -1284,6 +2544,7 @@ tinsertblank(Term *term, int n)
     line = term->line[term->c.y];
 
     memmove(&line[dst], &line[src], size * sizeof(Glyph));
+    tdamage(term, term->c.y, src, term->col-1);
     tclearregion(term, src, term->c.y, dst - 1, term->c.y);
 }
 
@@ -1301,10 +2562,13 @@ tdeleteline(Term *term, int n)
         tscrollup(term, term->c.y, n);
 }
 
-int32_t
-tdefcolor(Term *term, int *attr, int *npar, int l)
+/*
+ * Parse the color of a 38 or 48 attribute into *color. Returns 0 if it is
+ * invalid, as truecolors don't leave any value to flag that.
+ */
+int
+tdefcolor(Term *term, int *attr, int *npar, int l, uint32_t *color)
 {
-    int32_t idx = -1;
     uint r, g, b;
 
     switch (attr[*npar + 1]) {
@@ -1319,12 +2583,13 @@ tdefcolor(Term *term, int *attr, int *npar, int l)
         g = attr[*npar + 3];
         b = attr[*npar + 4];
         *npar += 4;
-        if (!BETWEEN(r, 0, 255) || !BETWEEN(g, 0, 255) || !BETWEEN(b, 0, 255))
+        if (!BETWEEN(r, 0, 255) || !BETWEEN(g, 0, 255) || !BETWEEN(b, 0, 255)) {
             fprintf(stderr, "erresc: bad rgb color (%u,%u,%u)\n",
                 r, g, b);
-        else
-            idx = TRUECOLOR(r, g, b);
-        break;
+            break;
+        }
+        *color = TRUECOLOR(r, g, b);
+        return 1;
     case 5: /* indexed color */
         if (*npar + 2 >= l) {
             fprintf(stderr,
@@ -1333,11 +2598,12 @@ tdefcolor(Term *term, int *attr, int *npar, int l)
             break;
         }
         *npar += 2;
-        if (!BETWEEN(attr[*npar], 0, 255))
+        if (!BETWEEN(attr[*npar], 0, 255)) {
             fprintf(stderr, "erresc: bad fgcolor %d\n", attr[*npar]);
-        else
-            idx = attr[*npar];
-        break;
+            break;
+        }
+        *color = attr[*npar];
+        return 1;
     case 0: /* implemented defined (only foreground) */
     case 1: /* transparent */
     case 3: /* direct color in CMY space */
@@ -1348,101 +2614,25 @@ tdefcolor(Term *term, int *attr, int *npar, int l)
         break;
     }
 
-    return idx;
+    return 0;
 }
 
 void
 tsetattr(Term *term, int *attr, int l)
 {
+    Style st = term->styles.data[term->c.attr.style];
     int i;
-    int32_t idx;
 
     for (i = 0; i < l; i++) {
         switch (attr[i]) {
-        case 0:
-            term->c.attr.mode &= ~(
-                ATTR_BOLD       |
-                ATTR_FAINT      |
-                ATTR_ITALIC     |
-                ATTR_UNDERLINE  |
-                ATTR_BLINK      |
-                ATTR_REVERSE    |
-                ATTR_INVISIBLE  |
-                ATTR_STRUCK     );
-            term->c.attr.fg = defaultfg;
-            term->c.attr.bg = defaultbg;
-            break;
-        case 1:
-            term->c.attr.mode |= ATTR_BOLD;
-            break;
-        case 2:
-            term->c.attr.mode |= ATTR_FAINT;
-            break;
-        case 3:
-            term->c.attr.mode |= ATTR_ITALIC;
-            break;
-        case 4:
-            term->c.attr.mode |= ATTR_UNDERLINE;
-            break;
-        case 5: /* slow blink */
-            /* FALLTHROUGH */
-        case 6: /* rapid blink */
-            term->c.attr.mode |= ATTR_BLINK;
-            break;
-        case 7:
-            term->c.attr.mode |= ATTR_REVERSE;
-            break;
-        case 8:
-            term->c.attr.mode |= ATTR_INVISIBLE;
-            break;
-        case 9:
-            term->c.attr.mode |= ATTR_STRUCK;
-            break;
-        case 22:
-            term->c.attr.mode &= ~(ATTR_BOLD | ATTR_FAINT);
-            break;
-        case 23:
-            term->c.attr.mode &= ~ATTR_ITALIC;
-            break;
-        case 24:
-            term->c.attr.mode &= ~ATTR_UNDERLINE;
-            break;
-        case 25:
-            term->c.attr.mode &= ~ATTR_BLINK;
-            break;
-        case 27:
-            term->c.attr.mode &= ~ATTR_REVERSE;
-            break;
-        case 28:
-            term->c.attr.mode &= ~ATTR_INVISIBLE;
-            break;
-        case 29:
-            term->c.attr.mode &= ~ATTR_STRUCK;
-            break;
         case 38:
-            if ((idx = tdefcolor(term, attr, &i, l)) >= 0)
-                term->c.attr.fg = idx;
-            break;
-        case 39:
-            term->c.attr.fg = defaultfg;
+            tdefcolor(term, attr, &i, l, &st.fg);
             break;
         case 48:
-            if ((idx = tdefcolor(term, attr, &i, l)) >= 0)
-                term->c.attr.bg = idx;
-            break;
-        case 49:
-            term->c.attr.bg = defaultbg;
+            tdefcolor(term, attr, &i, l, &st.bg);
             break;
         default:
-            if (BETWEEN(attr[i], 30, 37)) {
-                term->c.attr.fg = attr[i] - 30;
-            } else if (BETWEEN(attr[i], 40, 47)) {
-                term->c.attr.bg = attr[i] - 40;
-            } else if (BETWEEN(attr[i], 90, 97)) {
-                term->c.attr.fg = attr[i] - 90 + 8;
-            } else if (BETWEEN(attr[i], 100, 107)) {
-                term->c.attr.bg = attr[i] - 100 + 8;
-            } else {
+            if (!tsgrattr(&term->c.attr, &st, attr[i])) {
                 fprintf(stderr,
                     "erresc(default): gfx attr %d unknown\n",
                     attr[i]);
@@ -1451,6 +2641,153 @@ tsetattr(Term *term, int *attr, int l)
             break;
         }
     }
+    term->c.attr.style = tintern(term, st);
+}
+
+/*
+ * Apply SGR attribute a to g's mode and colors st, except colors 38 and 48.
+ * Returns 0 if unknown.
+ */
+int
+tsgrattr(Glyph *g, Style *st, int a)
+{
+    switch (a) {
+    case 0:
+        g->mode &= ~(
+            ATTR_BOLD       |
+            ATTR_FAINT      |
+            ATTR_ITALIC     |
+            ATTR_UNDERLINE  |
+            ATTR_BLINK      |
+            ATTR_REVERSE    |
+            ATTR_INVISIBLE  |
+            ATTR_STRUCK     );
+        st->fg = defaultfg;
+        st->bg = defaultbg;
+        break;
+    case 1:
+        g->mode |= ATTR_BOLD;
+        break;
+    case 2:
+        g->mode |= ATTR_FAINT;
+        break;
+    case 3:
+        g->mode |= ATTR_ITALIC;
+        break;
+    case 4:
+        g->mode |= ATTR_UNDERLINE;
+        break;
+    case 5: /* slow blink */
+        /* FALLTHROUGH */
+    case 6: /* rapid blink */
+        g->mode |= ATTR_BLINK;
+        break;
+    case 7:
+        g->mode |= ATTR_REVERSE;
+        break;
+    case 8:
+        g->mode |= ATTR_INVISIBLE;
+        break;
+    case 9:
+        g->mode |= ATTR_STRUCK;
+        break;
+    case 22:
+        g->mode &= ~(ATTR_BOLD | ATTR_FAINT);
+        break;
+    case 23:
+        g->mode &= ~ATTR_ITALIC;
+        break;
+    case 24:
+        g->mode &= ~ATTR_UNDERLINE;
+        break;
+    case 25:
+        g->mode &= ~ATTR_BLINK;
+        break;
+    case 27:
+        g->mode &= ~ATTR_REVERSE;
+        break;
+    case 28:
+        g->mode &= ~ATTR_INVISIBLE;
+        break;
+    case 29:
+        g->mode &= ~ATTR_STRUCK;
+        break;
+    case 39:
+        st->fg = defaultfg;
+        break;
+    case 49:
+        st->bg = defaultbg;
+        break;
+    default:
+        if (BETWEEN(a, 30, 37)) {
+            st->fg = a - 30;
+        } else if (BETWEEN(a, 40, 47)) {
+            st->bg = a - 40;
+        } else if (BETWEEN(a, 90, 97)) {
+            st->fg = a - 90 + 8;
+        } else if (BETWEEN(a, 100, 107)) {
+            st->bg = a - 100 + 8;
+        } else {
+            return 0;
+        }
+        break;
+    }
+    return 1;
+}
+
+/*
+ * Fast path for SGR, applies the parameters straight from the collected
+ * bytes. Only takes plain numbers and colors it can set, anything
+ * tsetattr() would complain about or csiparse() reads differently is left
+ * to them: returns 0 without changing the cursor attributes.
+ */
+int
+tsgr(Term *term)
+{
+    CSIEscape *csi = &term->csiescseq;
+    const char *p = csi->buf, *end = &csi->buf[csi->len - 1];
+    Glyph attr = term->c.attr;
+    Style st = term->styles.data[attr.style];
+    uint32_t *color = NULL;
+    int v, c[3], nc = 0, want = 0, narg = 0;
+
+    for (;;) {
+        for (v = 0; p < end && BETWEEN(*p, '0', '9'); p++) {
+            if ((v = v * 10 + *p - '0') > 255)
+                return 0;
+        }
+        if (++narg > ESC_ARG_SIZ || (p < end && *p != ';'))
+            return 0;
+
+        if (want < 0) {
+            /* 38 or 48, the kind of color */
+            if (v == 5)
+                want = 1;
+            else if (v == 2)
+                want = 3;
+            else
+                return 0;
+            nc = 0;
+        } else if (want > 0) {
+            c[nc++] = v;
+            if (--want == 0)
+                *color = (nc == 1) ? c[0] : TRUECOLOR(c[0], c[1], c[2]);
+        } else if (v == 38 || v == 48) {
+            color = (v == 38) ? &st.fg : &st.bg;
+            want = -1;
+        } else if (!tsgrattr(&attr, &st, v)) {
+            return 0;
+        }
+
+        if (p == end)
+            break;
+        p++;
+    }
+    if (want)
+        return 0;
+    attr.style = tintern(term, st);
+    term->c.attr = attr;
+    return 1;
 }
 
 void
@@ -1556,6 +2893,16 @@ tsetmode(Term *term, int priv, int set, int *args, int narg)
             case 2004: /* 2004: bracketed paste mode */
                 MODBIT(term->mode, set, MODE_BRCKTPASTE);
                 break;
+            case 2026: /* 2026: synchronized update */
+                if (set && !IS_SET(MODE_SYNC)) {
+                    term->syncstart = frame_millis();
+                    /* draw anyway once the timeout is up */
+                    frame_request(synctimeout);
+                } else if (!set && IS_SET(MODE_SYNC)) {
+                    frame_damage();
+                }
+                MODBIT(term->mode, set, MODE_SYNC);
+                break;
             /* Not implemented mouse modes. See comments there. */
             case 1001: /* mouse highlight mode; can hang the
                       terminal by design when implemented. */
@@ -1598,6 +2945,73 @@ tsetmode(Term *term, int priv, int set, int *args, int narg)
     }
 }
 
+/*
+ * Returns how DECRQM reports mode: 1 if it is set, 2 if it is reset and 0
+ * if it isn't known.
+ */
+int
+tgetmode(Term *term, int priv, int mode)
+{
+    int set;
+
+    if (priv) {
+        switch (mode) {
+        case 1: /* DECCKM */
+            set = IS_SET(MODE_APPCURSOR);
+            break;
+        case 5: /* DECSCNM */
+            set = IS_SET(MODE_REVERSE);
+            break;
+        case 6: /* DECOM */
+            set = term->c.state & CURSOR_ORIGIN;
+            break;
+        case 7: /* DECAWM */
+            set = IS_SET(MODE_WRAP);
+            break;
+        case 25: /* DECTCEM */
+            set = !IS_SET(MODE_HIDE);
+            break;
+        case 1004:
+            set = IS_SET(MODE_TTYFOCUS);
+            break;
+        case 1006:
+            set = IS_SET(MODE_MOUSESGR);
+            break;
+        case 47:
+        case 1047:
+        case 1049:
+            set = IS_SET(MODE_ALTSCREEN);
+            break;
+        case 2004:
+            set = IS_SET(MODE_BRCKTPASTE);
+            break;
+        case 2026:
+            set = IS_SET(MODE_SYNC);
+            break;
+        default:
+            return 0;
+        }
+    } else {
+        switch (mode) {
+        case 2: /* KAM */
+            set = IS_SET(MODE_KBDLOCK);
+            break;
+        case 4: /* IRM */
+            set = IS_SET(MODE_INSERT);
+            break;
+        case 12: /* SRM */
+            set = !IS_SET(MODE_ECHO);
+            break;
+        case 20: /* LNM */
+            set = IS_SET(MODE_CRLF);
+            break;
+        default:
+            return 0;
+        }
+    }
+    return set ? 1 : 2;
+}
+
 void
 csihandle(Term *term)
 {
@@ -1713,6 +3127,9 @@ csihandle(Term *term)
         case 2: /* all */
             tclearregion(term, 0, 0, term->col-1, term->row-1);
             break;
+        case 3: /* scrollback */
+            hclear(term);
+            break;
         default:
             goto unknown;
         }
@@ -1795,6 +3212,20 @@ csihandle(Term *term)
     case 'u': /* DECRC -- Restore cursor position (ANSI.SYS) */
         tcursor(term, CURSOR_LOAD);
         break;
+    case '$':
+        switch (term->csiescseq.mode[1]) {
+        case 'p': /* DECRQM -- Request Mode */
+            len = snprintf(buf, sizeof(buf), "\033[%s%d;%d$y",
+                    term->csiescseq.priv ? "?" : "",
+                    term->csiescseq.arg[0],
+                    tgetmode(term, term->csiescseq.priv,
+                        term->csiescseq.arg[0]));
+            ttywrite(term, buf, len, 0);
+            break;
+        default:
+            goto unknown;
+        }
+        break;
     case ' ':
         switch (term->csiescseq.mode[1]) {
         case 'q': /* DECSCUSR -- Set Cursor Style */
@@ -1838,13 +3269,32 @@ csireset(Term *term)
     memset(&term->csiescseq, 0, sizeof(term->csiescseq));
 }
 
+/*
+ * Act on the CSI sequence collected in csiescseq, plain SGR sequences are
+ * applied straight from the collected bytes.
+ */
+void
+csidispatch(Term *term)
+{
+    CSIEscape *csi = &term->csiescseq;
+
+    if (csi->buf[csi->len - 1] == 'm' && tsgr(term))
+        return;
+    csiparse(term);
+    csihandle(term);
+}
+
 void
 strhandle(Term *term)
 {
     char *p = NULL, *dec;
     int j, narg, par;
 
-    term->esc &= ~(ESC_STR_END|ESC_STR);
+    term->strend = 0;
+    if (term->strescseq.toolong) {
+        fprintf(stderr, "erresc: str longer than %u bytes\n", strmax);
+        return;
+    }
     strparse(term);
     par = (narg = term->strescseq.narg) ? atoi(term->strescseq.args[0]) : 0;
 
@@ -1866,14 +3316,22 @@ strhandle(Term *term)
                 xsettitle(term->strescseq.args[1]);
             return;
         case 52:
-            if (narg > 2 && allowwindowops) {
+            if (term->strescseq.b64) {
+                /* decoded as it arrived */
+                strb64end(term);
+                dec = xrealloc(term->strescseq.dec, term->strescseq.declen + 1);
+                dec[term->strescseq.declen] = '\0';
+                term->strescseq.dec = NULL;
+            } else if (narg > 2 && allowwindowops) {
                 dec = base64dec(term->strescseq.args[2]);
-                if (dec) {
-                    xsetsel(dec);
-                    xclipcopy();
-                } else {
-                    fprintf(stderr, "erresc: invalid base64\n");
-                }
+            } else {
+                return;
+            }
+            if (dec) {
+                xsetsel(dec);
+                xclipcopy();
+            } else {
+                fprintf(stderr, "erresc: invalid base64\n");
             }
             return;
         case 4: /* color set */
@@ -1959,12 +3417,138 @@ strdump(Term *term)
 void
 strreset(Term *term)
 {
+    free(term->strescseq.dec);
     term->strescseq = (STREscape){
         .buf = xrealloc(term->strescseq.buf, STR_BUF_SIZ),
         .siz = STR_BUF_SIZ,
     };
 }
 
+/*
+ * Append n bytes to the string sequence. The payload of sequences which are
+ * ignored anyway is dropped on arrival, and the data of OSC 52 is base64
+ * decoded as it arrives instead of being kept for strhandle().
+ */
+void
+strput(Term *term, const char *s, size_t n)
+{
+    STREscape *str = &term->strescseq;
+    size_t i, len = n;
+    int split = 0;
+
+    switch (str->type) {
+    case 'P': /* DCS -- Device Control String */
+    case '_': /* APC -- Application Program Command */
+    case '^': /* PM -- Privacy Message */
+        return;
+    }
+    if (str->toolong)
+        return;
+    if (str->b64) {
+        /* nothing after the OSC 52 data is used */
+        if (str->b64 == 1)
+            strb64(term, s, n);
+        return;
+    }
+
+    if (str->type == ']') {
+        for (i = 0; i < n && str->nsemi < 2; i++) {
+            if (s[i] == ';' && ++str->nsemi == 2) {
+                len = i + 1;
+                split = 1;
+            }
+        }
+    }
+    if (str->len + len > strmax) {
+        str->toolong = 1;
+        return;
+    }
+    if (str->len + len >= str->siz) {
+        while (str->len + len >= str->siz)
+            str->siz *= 2;
+        str->buf = xrealloc(str->buf, str->siz);
+    }
+    memcpy(&str->buf[str->len], s, len);
+    str->len += len;
+    if (!split)
+        return;
+
+    /* same test as strparse() and strhandle() on the full string */
+    str->buf[str->len] = '\0';
+    if (allowwindowops && !memchr(str->buf, '\0', str->len) &&
+            atoi(str->buf) == 52)
+        str->b64 = 1;
+    strput(term, s + len, n - len);
+}
+
+/* Decode OSC 52 data like base64dec() does, a chunk at a time */
+void
+strb64(Term *term, const char *s, size_t n)
+{
+    STREscape *str = &term->strescseq;
+    size_t i;
+    uchar c;
+
+    for (i = 0; i < n && str->b64 == 1; i++) {
+        c = s[i];
+        if (c == ';' || c == '\0') {
+            strb64end(term);
+        } else if (isprint(c)) {
+            str->quad[str->nquad++] = c;
+            if (str->nquad == 4 && !strb64quad(term))
+                str->b64 = 2;
+        }
+    }
+}
+
+/* Returns 0 once the data ended or was too long */
+int
+strb64quad(Term *term)
+{
+    STREscape *str = &term->strescseq;
+    int a = base64_digits[(uchar) str->quad[0]];
+    int b = base64_digits[(uchar) str->quad[1]];
+    int c = base64_digits[(uchar) str->quad[2]];
+    int d = base64_digits[(uchar) str->quad[3]];
+    char *dst;
+
+    str->nquad = 0;
+    if (str->declen + 3 > str->decsiz) {
+        if (str->declen + 3 > strmax) {
+            str->toolong = 1;
+            return 0;
+        }
+        str->decsiz = MAX(str->decsiz * 2, STR_BUF_SIZ);
+        str->dec = xrealloc(str->dec, str->decsiz);
+    }
+    dst = &str->dec[str->declen];
+
+    if (a == -1 || b == -1)
+        return 0;
+    *dst++ = (a << 2) | ((b & 0x30) >> 4);
+    if (c != -1) {
+        *dst++ = ((b & 0x0f) << 4) | ((c & 0x3c) >> 2);
+        if (d != -1)
+            *dst++ = ((c & 0x03) << 6) | d;
+    }
+    str->declen = dst - str->dec;
+    return c != -1 && d != -1;
+}
+
+void
+strb64end(Term *term)
+{
+    STREscape *str = &term->strescseq;
+
+    if (str->b64 == 1 && str->nquad) {
+        /* emulate padding */
+        while (str->nquad < 4)
+            str->quad[str->nquad++] = '=';
+        strb64quad(term);
+    }
+    str->b64 = 2;
+}
+
 void
 sendbreak(Term *term, const Arg *arg)
 {
@@ -2107,7 +3691,6 @@ tstrsequence(Term *term, uchar c)
     }
     strreset(term);
     term->strescseq.type = c;
-    term->esc |= ESC_STR;
 }
 
 void
@@ -2130,7 +3713,7 @@ tcontrolcode(Term *term, uchar ascii)
         tnewline(term, IS_SET(MODE_CRLF));
         return;
     case '\a':   /* BEL */
-        if (term->esc & ESC_STR_END) {
+        if (term->strend) {
             /* backwards compatibility to xterm */
             strhandle(term);
         } else {
@@ -2139,8 +3722,6 @@ tcontrolcode(Term *term, uchar ascii)
         break;
     case '\033': /* ESC */
         csireset(term);
-        term->esc &= ~(ESC_CSI|ESC_ALTCHARSET|ESC_TEST);
-        term->esc |= ESC_START;
         return;
     case '\016': /* SO (LS1 -- Locking shift 1) */
     case '\017': /* SI (LS0 -- Locking shift 0) */
@@ -2204,33 +3785,28 @@ tcontrolcode(Term *term, uchar ascii)
         return;
     }
     /* only CAN, SUB, \a and C1 chars interrupt a sequence */
-    term->esc &= ~(ESC_STR_END|ESC_STR);
+    term->strend = 0;
 }
 
 /*
- * returns 1 when the sequence is finished and it hasn't to read
- * more characters for this sequence, otherwise 0
+ * Handle the character following ESC. Characters which start a longer
+ * sequence only prepare for it, vtstates moves on to the sequence's state.
  */
-int
+void
 eschandle(Term *term, uchar ascii)
 {
     switch (ascii) {
-    case '[':
-        term->esc |= ESC_CSI;
-        return 0;
-    case '#':
-        term->esc |= ESC_TEST;
-        return 0;
-    case '%':
-        term->esc |= ESC_UTF8;
-        return 0;
+    case '[': /* CSI -- Control Sequence Introducer */
+    case '#': /* DEC screen alignment test follows */
+    case '%': /* UTF-8 mode selection follows */
+        break;
     case 'P': /* DCS -- Device Control String */
     case '_': /* APC -- Application Program Command */
     case '^': /* PM -- Privacy Message */
     case ']': /* OSC -- Operating System Command */
     case 'k': /* old title set compatibility */
         tstrsequence(term, ascii);
-        return 0;
+        break;
     case 'n': /* LS2 -- Locking shift 2 */
     case 'o': /* LS3 -- Locking shift 3 */
         term->charset = 2 + (ascii - 'n');
@@ -2240,8 +3816,7 @@ eschandle(Term *term, uchar ascii)
     case '*': /* G2D4 -- set tertiary charset G2 */
     case '+': /* G3D4 -- set quaternary charset G3 */
         term->icharset = ascii - '(';
-        term->esc |= ESC_ALTCHARSET;
-        return 0;
+        break;
     case 'D': /* IND -- Linefeed */
         if (term->c.y == term->bot) {
             tscrollup(term, term->top, 1);
@@ -2283,7 +3858,7 @@ eschandle(Term *term, uchar ascii)
         tcursor(term, CURSOR_LOAD);
         break;
     case '\\': /* ST -- String Terminator */
-        if (term->esc & ESC_STR_END)
+        if (term->strend)
             strhandle(term);
         break;
     default:
@@ -2291,124 +3866,109 @@ eschandle(Term *term, uchar ascii)
             (uchar) ascii, isprint(ascii)? ascii:'.');
         break;
     }
-    return 1;
 }
 
 void
 tputc(Term *term, Rune u)
 {
     char c[UTF_SIZ];
-    int control;
-    int width, len;
-    Glyph *gp;
+    int len, t;
 
-    control = ISCONTROL(u);
     if (u < 127 || !IS_SET(MODE_UTF8)) {
         c[0] = u;
-        width = len = 1;
+        len = 1;
     } else {
         len = utf8encode(u, c);
-        if (!control && (width = wcwidth(u)) == -1)
-            width = 1;
     }
 
     if (IS_SET(MODE_PRINT))
         tprinter(term, c, len);
 
-    /*
-     * STR sequence must be checked before anything else
-     * because it uses all following characters until it
-     * receives a ESC, a SUB, a ST or any other C1 control
-     * character.
-     */
-    if (term->esc & ESC_STR) {
-        if (u == '\a' || u == 030 || u == 032 || u == 033 ||
-           ISCONTROLC1(u)) {
-            term->esc &= ~(ESC_START|ESC_STR);
-            term->esc |= ESC_STR_END;
-            goto check_control_code;
-        }
-
-        if (term->strescseq.len+len >= term->strescseq.siz) {
-            /*
-             * Here is a bug in terminals. If the user never sends
-             * some code to stop the str or esc command, then st
-             * will stop responding. But this is better than
-             * silently failing with unknown characters. At least
-             * then users will report back.
-             *
-             * In the case users ever get fixed, here is the code:
-             */
-            /*
-             * term->esc = 0;
-             * strhandle();
-             */
-            if (term->strescseq.siz > (SIZE_MAX - UTF_SIZ) / 2)
-                return;
-            term->strescseq.siz *= 2;
-            term->strescseq.buf = xrealloc(term->strescseq.buf, term->strescseq.siz);
-        }
-
-        memmove(&term->strescseq.buf[term->strescseq.len], c, len);
-        term->strescseq.len += len;
+    t = vtstates[term->esc][u < LEN(vtclass) ? vtclass[u] : VC_HIGH];
+    term->esc = VTSTATE(t);
+    switch (VTACTION(t)) {
+    case VA_PRINT:
+        tputglyph(term, u);
         return;
-    }
-
-check_control_code:
-    /*
-     * Actions of control codes must be performed as soon they arrive
-     * because they can be embedded inside a control sequence, and
-     * they must not cause conflicts with sequences.
-     */
-    if (control) {
+    case VA_STREND:
+        term->strend = 1;
+        /* FALLTHROUGH */
+    case VA_EXEC:
         tcontrolcode(term, u);
         /*
          * control codes are not shown ever
          */
-        if (!term->esc)
+        if (term->esc == ESC_GROUND && !term->strend)
             term->lastc = 0;
         return;
-    } else if (term->esc & ESC_START) {
-        if (term->esc & ESC_CSI) {
-            term->csiescseq.buf[term->csiescseq.len++] = u;
-            if (BETWEEN(u, 0x40, 0x7E)
-                    || term->csiescseq.len >= \
-                    sizeof(term->csiescseq.buf)-1) {
-                term->esc = 0;
-                csiparse(term);
-                csihandle(term);
-            }
-            return;
-        } else if (term->esc & ESC_UTF8) {
-            tdefutf8(term, u);
-        } else if (term->esc & ESC_ALTCHARSET) {
-            tdeftran(term, u);
-        } else if (term->esc & ESC_TEST) {
-            tdectest(term, u);
-        } else {
-            if (!eschandle(term, u))
-                return;
-            /* sequence already finished */
-        }
-        term->esc = 0;
+    case VA_PUT:
         /*
-         * All characters which form part of a sequence are not
-         * printed
+         * A sequence which never ends swallows all output, but this is
+         * better than silently failing with unknown characters. At
+         * least then users will report back. strput() drops what goes
+         * past strmax, so it can't take all memory either.
          */
+        strput(term, c, len);
         return;
+    case VA_ESC:
+        eschandle(term, u);
+        break;
+    case VA_COLLECT:
+        term->csiescseq.buf[term->csiescseq.len++] = u;
+        if (term->csiescseq.len < sizeof(term->csiescseq.buf)-1)
+            return;
+        /* give up on the sequence once the buffer is full */
+        term->esc = ESC_GROUND;
+        csidispatch(term);
+        break;
+    case VA_CSI:
+        term->csiescseq.buf[term->csiescseq.len++] = u;
+        csidispatch(term);
+        break;
+    case VA_CHARSET:
+        tdeftran(term, u);
+        break;
+    case VA_TEST:
+        tdectest(term, u);
+        break;
+    case VA_UTF8:
+        tdefutf8(term, u);
+        break;
     }
+    /* an ST can only follow the string directly */
+    if (term->esc == ESC_GROUND)
+        term->strend = 0;
+}
+
+/*
+ * Print a rune outside of any sequence at the cursor.
+ */
+void
+tputglyph(Term *term, Rune u)
+{
+    int width;
+    Glyph *gp;
+
+    width = (u < 127 || !IS_SET(MODE_UTF8)) ? 1 : char_width(u);
+    /* a glyph holds a single rune, there is nothing to combine it with */
+    if (width == 0)
+        return;
+
     if (selected(term, term->c.x, term->c.y))
         selclear(term);
 
     gp = &term->line[term->c.y][term->c.x];
     if (IS_SET(MODE_WRAP) && (term->c.state & CURSOR_WRAPNEXT)) {
         gp->mode |= ATTR_WRAP;
+        term->lineattr[term->c.y] |= ATTR_WRAP;
         tnewline(term, 1);
         gp = &term->line[term->c.y][term->c.x];
     }
 
-    if (IS_SET(MODE_INSERT) && term->c.x+width < term->col)
+    if (IS_SET(MODE_INSERT) && term->c.x+width < term->col) {
         memmove(gp+width, gp, (term->col - term->c.x - width) * sizeof(Glyph));
+        tdamage(term, term->c.y, term->c.x, term->col-1);
+    }
 
     if (term->c.x+width > term->col) {
         tnewline(term, 1);
@@ -2420,6 +3980,7 @@ check_control_code:
 
     if (width == 2) {
         gp->mode |= ATTR_WIDE;
+        term->lineattr[term->c.y] |= ATTR_WIDE | ATTR_WDUMMY;
         if (term->c.x+1 < term->col) {
             gp[1].u = '\0';
             gp[1].mode = ATTR_WDUMMY;
@@ -2432,14 +3993,186 @@ check_control_code:
     }
 }
 
+/*
+ * Run of VA_PRINT: printable ASCII outside of any sequence, with the
+ * charset not translating it. Writes the glyphs straight into the line a
+ * row at a time, with the same result as calling tputc() for each of them.
+ * Returns the number of bytes consumed, 0 if the fast path doesn't apply.
+ */
+int
+tputascii(Term *term, const char *s, int n)
+{
+    Glyph *line;
+    int x, y, i, chunk, len = 0;
+
+    if (IS_SET(MODE_INSERT) || term->trantbl[term->charset] == CS_GRAPHIC0)
+        return 0;
+    len = utf8printable(s, n);
+    if (!len)
+        return 0;
+
+    s += len;
+    n = len;
+    if (!IS_SET(MODE_WRAP) && (term->c.state & CURSOR_WRAPNEXT))
+        n = 1; /* all but the last glyph would be overwritten */
+    s -= n;
+
+    while (n > 0) {
+        if (IS_SET(MODE_WRAP) && (term->c.state & CURSOR_WRAPNEXT)) {
+            term->line[term->c.y][term->c.x].mode |= ATTR_WRAP;
+            term->lineattr[term->c.y] |= ATTR_WRAP;
+            tnewline(term, 1);
+        }
+        x = term->c.x;
+        y = term->c.y;
+        line = term->line[y];
+        chunk = MIN(n, term->col - x);
+
+        if (term->sel.mode != SEL_EMPTY) {
+            for (i = 0; i < chunk; i++) {
+                if (selected(term, x + i, y)) {
+                    selclear(term);
+                    break;
+                }
+            }
+        }
+
+        /* only wide chars cut at the ends of the run need fixing up */
+        if ((line[x].mode & ATTR_WDUMMY) && x > 0) {
+            line[x-1].u = ' ';
+            line[x-1].mode &= ~ATTR_WIDE;
+        }
+        if ((line[x+chunk-1].mode & ATTR_WIDE) && x+chunk < term->col) {
+            line[x+chunk].u = ' ';
+            line[x+chunk].mode &= ~ATTR_WDUMMY;
+        }
+        for (i = 0; i < chunk; i++) {
+            line[x+i] = term->c.attr;
+            line[x+i].u = s[i];
+        }
+        tdamage(term, y, x-1, x+chunk);
+        term->lineattr[y] |= term->c.attr.mode;
+        if (y >= term->nlines)
+            term->nlines = y + 1;
+        term->lastc = s[chunk-1];
+
+        if (x + chunk < term->col) {
+            tmoveto(term, x + chunk, y);
+        } else {
+            if (chunk > 1)
+                tmoveto(term, term->col - 1, y);
+            term->c.state |= CURSOR_WRAPNEXT;
+        }
+        s += chunk;
+        n -= chunk;
+    }
+    return len;
+}
+
+/*
+ * Run of VA_COLLECT: collects the parameter and intermediate bytes of a CSI
+ * sequence up to the final byte in one go and dispatches the sequence, with
+ * the same result as feeding them to tputc() one by one. Returns the number
+ * of bytes consumed.
+ */
+int
+tputcsi(Term *term, const char *s, int n)
+{
+    CSIEscape *csi = &term->csiescseq;
+    const uchar *row = vtstates[ESC_CSI];
+    int len, room, utf8 = IS_SET(MODE_UTF8);
+
+    for (len = 0; len < n &&
+            VTACTION(row[VTBYTECLASS((uchar)s[len], utf8)]) == VA_COLLECT;
+            len++)
+        ;
+    room = sizeof(csi->buf) - 1 - csi->len;
+    if (len < room && len < n &&
+            VTACTION(row[VTBYTECLASS((uchar)s[len], utf8)]) == VA_CSI) {
+        len++;
+    } else if (len >= room) {
+        /* tputc() gives up on the sequence once the buffer is full */
+        len = room;
+    } else {
+        memcpy(csi->buf + csi->len, s, len);
+        csi->len += len;
+        return len;
+    }
+    memcpy(csi->buf + csi->len, s, len);
+    csi->len += len;
+    term->esc = ESC_GROUND;
+    term->strend = 0;
+    csidispatch(term);
+    return len;
+}
+
+/*
+ * Run of VA_PUT: appends the body of a string sequence up to the first byte
+ * which may end it. Returns the number of bytes consumed.
+ */
+int
+tputstr(Term *term, const char *s, int n)
+{
+    const uchar *row = vtstates[ESC_STR];
+    int len, utf8 = IS_SET(MODE_UTF8);
+
+    for (len = 0; len < n &&
+            VTACTION(row[VTBYTECLASS((uchar)s[len], utf8)]) == VA_PUT;
+            len++)
+        ;
+    strput(term, s, len);
+    return len;
+}
+
+/*
+ * Feed the bytes to the escape sequence parser. Runs of bytes which the
+ * current state handles the same way are consumed at once, everything else
+ * goes through tputc() a rune at a time. Returns the number of bytes
+ * consumed, which is short of buflen when the buffer ends in an incomplete
+ * UTF-8 sequence.
+ */
 int
 twrite(Term *term, const char *buf, int buflen, int show_ctrl)
 {
-    int charsize;
-    Rune u;
+    int charsize, t;
+    Rune u, runes[64];
+    size_t i, nu;
     int n;
 
     for (n = 0; n < buflen; n += charsize) {
+        t = vtstates[term->esc][VTBYTECLASS((uchar)buf[n], IS_SET(MODE_UTF8))];
+        charsize = 0;
+        /* the printer gets a copy of every rune */
+        if (!IS_SET(MODE_PRINT)) {
+            switch (VTACTION(t)) {
+            case VA_PRINT:
+                charsize = tputascii(term, buf + n, buflen - n);
+                break;
+            case VA_COLLECT:
+                charsize = tputcsi(term, buf + n, buflen - n);
+                break;
+            case VA_PUT:
+                /* controls are put as they are, not in caret notation */
+                if (!show_ctrl)
+                    charsize = tputstr(term, buf + n, buflen - n);
+                break;
+            }
+            if (charsize)
+                continue;
+        }
+        if (VTACTION(t) == VA_DECODE && !show_ctrl) {
+            /*
+             * Decode multibyte sequences in bulk. Only ASCII can change
+             * MODE_UTF8, so it stays the same for the whole run.
+             */
+            nu = LEN(runes);
+            charsize = utf8decoderun(buf + n, buflen - n, runes, &nu);
+            if (charsize == 0)
+                break;
+            for (i = 0; i < nu; i++)
+                tputc(term, runes[i]);
+            continue;
+        }
         if (IS_SET(MODE_UTF8)) {
             /* process a complete utf8 char */
             charsize = utf8decode(buf + n, &u, buflen - n);
@@ -2487,10 +4220,12 @@ st_perror(Term *term, char *s) {
 void
 tresize(Term *term, int col, int row)
 {
-    int i;
+    int i, slide;
     int minrow = MIN(row, term->row);
     int mincol = MIN(col, term->col);
     int *bp;
+    Glyph *cells;
+    Line *line, *alt;
     TCursor c;
 
     if (col < 1 || row < 1) {
@@ -2502,39 +4237,47 @@ tresize(Term *term, int col, int row)
     /*
      * slide screen to keep cursor where we expect it -
      * tscrollup would work here, but we can optimize to
-     * memmove because we're freeing the earlier lines
+     * memmove because we're dropping the earlier lines
      */
-    for (i = 0; i <= term->c.y - row; i++) {
-        free(term->line[i]);
-        free(term->alt[i]);
+    slide = MAX(term->c.y - row + 1, 0);
+    for (i = 0; i < slide; i++)
+        hpush(term, IS_SET(MODE_ALTSCREEN) ? term->alt[i] : term->line[i]);
+    /* the attribute summaries slide along with their lines */
+    if (slide > 0) {
+        memmove(term->lineattr, term->lineattr + slide, row * sizeof(ushort));
+        memmove(term->altattr, term->altattr + slide, row * sizeof(ushort));
     }
-    /* ensure that both src and dst are not NULL */
-    if (i > 0) {
-        memmove(term->line, term->line + i, row * sizeof(Line));
-        memmove(term->alt, term->alt + i, row * sizeof(Line));
+
+    /*
+     * both screens live in one allocation, scrolling only moves the row
+     * pointers around. It is left uninitialized, the clearing of both
+     * screens below covers every cell that isn't copied.
+     */
+    cells = xmalloc(2 * row * col * sizeof(Glyph));
+    line = xmalloc(row * sizeof(Line));
+    alt = xmalloc(row * sizeof(Line));
+    for (i = 0; i < row; i++) {
+        line[i] = cells + i * col;
+        alt[i] = cells + (row + i) * col;
     }
-    for (i += row; i < term->row; i++) {
-        free(term->line[i]);
-        free(term->alt[i]);
+    for (i = 0; i < minrow; i++) {
+        memcpy(line[i], term->line[slide + i], mincol * sizeof(Glyph));
+        memcpy(alt[i], term->alt[slide + i], mincol * sizeof(Glyph));
     }
+    free(term->cells);
+    free(term->line);
+    free(term->alt);
+    term->cells = cells;
+    term->line = line;
+    term->alt = alt;
 
     /* resize to new height */
-    term->line = xrealloc(term->line, row * sizeof(Line));
-    term->alt  = xrealloc(term->alt,  row * sizeof(Line));
     term->dirty = xrealloc(term->dirty, row * sizeof(*term->dirty));
+    term->lineattr = xrealloc(term->lineattr, row * sizeof(ushort));
+    term->altattr = xrealloc(term->altattr, row * sizeof(ushort));
+    for (i = minrow; i < row; i++)
+        term->dirty[i] = (LineDamage){ .x1 = 1, .x2 = 0 };
     term->tabs = xrealloc(term->tabs, col * sizeof(*term->tabs));
-
-    /* resize each row to new width, zero-pad if needed */
-    for (i = 0; i < minrow; i++) {
-        term->line[i] = xrealloc(term->line[i], col * sizeof(Glyph));
-        term->alt[i]  = xrealloc(term->alt[i],  col * sizeof(Glyph));
-    }
-
-    /* allocate any new rows */
-    for (/* i = minrow */; i < row; i++) {
-        term->line[i] = xmalloc(col * sizeof(Glyph));
-        term->alt[i] = xmalloc(col * sizeof(Glyph));
-    }
     if (col > term->col) {
         bp = term->tabs + term->col;
 
@@ -2551,7 +4294,7 @@ tresize(Term *term, int col, int row)
     tsetscroll(term, 0, row-1);
     /* make use of the LIMIT in tmoveto */
     tmoveto(term, term->c.x, term->c.y);
-    /* Clearing both screens (it makes dirty all lines) */
+    /* Clearing both screens (it makes dirty all lines), new cells need it */
     c = term->c;
     for (i = 0; i < 2; i++) {
         if (mincol < col && 0 < minrow) {
@@ -2583,6 +4326,21 @@ void st_set_focused(Term *term, int set) {
     }
 }
 
+/*
+ * Scroll the view back n lines into the history, or forward for a negative
+ * n. The widget clamps the view once it knows its height.
+ */
+void st_scroll(Term *term, int n) {
+    int nhist = term->hist.n + term->hist.nspill;
+
+    n += term->scroll;
+    LIMIT(n, 0, nhist);
+    if (n != term->scroll) {
+        term->scroll = n;
+        frame_damage();
+    }
+}
+
 int st_set_cursor(Term *term, int cursor) {
     if (cursor < 0 || cursor > 7) return 1;
     term->cursorshape = cursor;
@@ -19,6 +19,8 @@
 #define ESC_ARG_SIZ   16
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
+#define READ_BUF_SIZ  (64*1024)
+#define TTYWRITE_IOV  32
 
 /* macros */
 #define MIN(a, b)        ((a) < (b) ? (a) : (b))
@@ -28,8 +30,7 @@
 #define DIVCEIL(n, d)        (((n) + ((d) - 1)) / (d))
 #define DEFAULT(a, b)        (a) = (a) ? (a) : (b)
 #define LIMIT(x, a, b)        (x) = (x) < (a) ? (a) : (x) > (b) ? (b) : (x)
-#define ATTRCMP(a, b)        ((a).mode != (b).mode || (a).fg != (b).fg || \
-                (a).bg != (b).bg)
+#define ATTRCMP(a, b)        ((a).mode != (b).mode || (a).style != (b).style)
 #define TIMEDIFF(t1, t2)    ((t1.tv_sec-t2.tv_sec)*1000 + \
                 (t1.tv_nsec-t2.tv_nsec)/1E6)
 #define MODBIT(x, set, bit)    ((set) ? ((x) |= (bit)) : ((x) &= ~(bit)))
@@ -77,12 +78,22 @@ typedef unsigned short ushort;
 
 typedef uint_least32_t Rune;
 
+/* Glyph colors, interned in a table per Term */
+typedef struct {
+    uint32_t fg;      /* foreground  */
+    uint32_t bg;      /* background  */
+} Style;
+
+typedef vec_t(Style) vec_style_t;
+
+/* Number of styles a Term can have, Glyph.style must hold the index */
+#define STYLE_MAX     (1 << 16)
+
 #define Glyph Glyph_
 typedef struct {
     Rune u;           /* character code */
     ushort mode;      /* attribute flags */
-    uint32_t fg;      /* foreground  */
-    uint32_t bg;      /* background  */
+    ushort style;     /* colors, index into the Term's styles, 0 is default */
 } Glyph;
 
 typedef Glyph *Line;
@@ -121,6 +132,7 @@ enum term_mode {
     MODE_MOUSEMANY   = 1 << 22,
     MODE_BRCKTPASTE  = 1 << 23,
     MODE_NUMLOCK     = 1 << 24,
+    MODE_SYNC        = 1 << 25,
     MODE_MOUSE       = MODE_MOUSEBTN|MODE_MOUSEMOTION|MODE_MOUSEX10\
                       |MODE_MOUSEMANY,
 };
@@ -146,14 +158,16 @@ enum charset {
     CS_FIN
 };
 
+/* states of the escape sequence parser, see vtstates in st.c */
 enum escape_state {
-    ESC_START      = 1,
-    ESC_CSI        = 2,
-    ESC_STR        = 4,  /* DCS, OSC, PM, APC */
-    ESC_ALTCHARSET = 8,
-    ESC_STR_END    = 16, /* a final string was encountered */
-    ESC_TEST       = 32, /* Enter in test mode */
-    ESC_UTF8       = 64,
+    ESC_GROUND,
+    ESC_START,
+    ESC_CSI,
+    ESC_STR,       /* DCS, OSC, PM, APC */
+    ESC_ALTCHARSET,
+    ESC_TEST,      /* Enter in test mode */
+    ESC_UTF8,
+    ESC_NSTATES,
 };
 
 typedef struct {
@@ -201,24 +215,90 @@ typedef struct {
     size_t len;            /* raw string length */
     char *args[STR_ARG_SIZ];
     int narg;              /* nb of args */
+    int nsemi;             /* ';' seen, up to 2 */
+    int toolong;           /* longer than strmax, dropped */
+    int b64;               /* OSC 52 data: 1 decoding, 2 done */
+    char quad[4];          /* base64 chars not decoded yet */
+    int nquad;
+    char *dec;             /* decoded OSC 52 data */
+    size_t decsiz;
+    size_t declen;
 } STREscape;
 
+/* What changed on a line since it was last drawn */
+typedef struct {
+    int x1, x2;   /* changed columns, none if x1 > x2 */
+    int scrolled; /* the line moved, all of it must be drawn */
+} LineDamage;
+
+/* A line in the history, compressed once it leaves the hot window */
+typedef struct {
+    Line line;    /* glyphs, NULL once compressed */
+    uchar *z;     /* compressed glyphs */
+    int len;      /* glyphs in the line, the width when it scrolled off */
+    int zlen;     /* bytes in z */
+} HistLine;
+
+typedef vec_t(off_t) vec_off_t;
+
+/*
+ * Lines scrolled off the top of the main screen, oldest first. The oldest
+ * ones are moved out of memory to a spill file, the rest are in a ring.
+ */
+typedef struct {
+    HistLine *line; /* ring of lines */
+    int size;     /* slots in the ring */
+    int head;     /* slot of the oldest line */
+    int n;        /* number of lines in the ring */
+    size_t bytes; /* memory held by the lines */
+    unsigned long changes; /* bumped whenever the lines change */
+    Line spare;   /* memory of a freed line, for the next one pushed */
+    int spillfd;  /* spill file, -1 until needed */
+    int nspill;   /* number of lines in the spill file */
+    int spillfirst;    /* oldest line's number, counted from spillidx[0] */
+    off_t spilloff;    /* where the oldest line starts */
+    off_t spillend;    /* where the next line is written */
+    off_t spillwrap;   /* end of the older lines once writing went back to
+                          the start of the file, else 0 */
+    off_t spillsize;   /* size of the file */
+    size_t spillbytes; /* bytes of lines still kept */
+    vec_off_t spillidx; /* offset of every HSPILLSTEP'th line */
+    int spillfailed;   /* the file failed, keep lines in memory until
+                          it is emptied */
+    uchar *map;   /* the file mapped for reading */
+    size_t maplen;
+} History;
+
 /* Internal representation of the screen */
 typedef struct {
     int row;      /* nb row */
     int col;      /* nb col */
     int nlines;   /* number of lines used */
     int lastx, lasty;
+    int lastline; /* line drawn at the bottom of the widget */
     Line *line;   /* screen */
     Line *alt;    /* alternate screen */
-    int *dirty;   /* dirtyness of lines */
+    Glyph *cells; /* glyphs of both screens, line and alt point into it */
+    LineDamage *dirty; /* dirtyness of lines */
+    History hist; /* scrollback */
+    unsigned long lasthist; /* hist.changes when last drawn */
+    int scroll;   /* lines the view is scrolled back, 0 at the bottom */
+    int lastscroll; /* scroll when last drawn */
+    ushort *lineattr; /* attributes that may be on each line */
+    ushort *altattr;  /* same for the alternate screen */
     TCursor c;    /* cursor */
-    int ocx;      /* old cursor col */
-    int ocy;      /* old cursor row */
+    TCursor saved[2]; /* cursors saved on the main and alternate screen */
+    vec_style_t styles; /* colors of the glyphs, see tintern() */
+    vec_int_t freestyles; /* unused entries in styles */
+    int *stylehash;   /* open addressing table of style index + 1 */
+    int stylehashsiz; /* slots in stylehash, a power of two */
+    int ocx;      /* screen col of the cursor drawn last */
+    int ocy;      /* screen row of the cursor drawn last, -1 if none */
     int top;      /* top    scroll limit */
     int bot;      /* bottom scroll limit */
     int mode;     /* terminal mode flags */
-    int esc;      /* escape state flags */
+    int esc;      /* escape state */
+    int strend;   /* a string sequence ended, ST may follow */
     char trantbl[4]; /* charset table translation */
     int charset;  /* current charset */
     int icharset; /* selected charset for sequence */
@@ -235,8 +315,17 @@ typedef struct {
     int childexitst;
     vec_char_t wbuf; /* write buffer */
     int wbuf_offs; /* offset into write buffer */
+    char *rbuf;    /* read buffer, keeps incomplete UTF-8 between reads */
+    int rbuflen;   /* unprocessed bytes in read buffer */
+    int rbudget;   /* bytes left to read this frame */
+    int throttled; /* the pty was not read for a while last frame */
+    int deferred;  /* reading was cut short by the time slice */
+    int hup;       /* hung up while out of budget, cmdfd is not polled */
+    struct ptysrc *reader; /* set when read by the pty reader thread */
+    int pollout;   /* cmdfd is polled for POLLOUT while read by the reader */
     int cursorshape;
     int blinkelapsed;
+    long long syncstart; /* when the synchronized update began */
 } Term;
 
 void die(const char *, ...);
@@ -251,17 +340,26 @@ void toggleprinter(Term *term, const Arg *);
 int tattrset(Term *term, int);
 void tnew(Term *term, int, int);
 void tresize(Term *term, int, int);
+Line thist(Term *term, int, int *, const Style **);
 void tsetdirtattr(Term *term, int);
 void ttyhangup(Term *term);
 int ttynew(Term *term, char *, char *, char *, char **);
 int st_fork_pty(Term *term);
+int st_attach_pty(Term *term, int fd);
 void st_set_child_status(Term *term, int status);
-size_t term_read(Term *term);
+ssize_t term_read(Term *term);
+void st_reset_budget(Term *term);
+int st_syncing(Term *term);
+void st_slice_begin(void);
+void st_slice_end(void);
+int st_run_deferred(void);
+int st_ptys_open(void);
 void ttyresize(Term *term, int, int);
 void ttywrite(Term *term, const char *, size_t, int);
 void st_print(Term *term, const char *s, int len);
 void st_perror(Term *term, char *s);
 void st_set_focused(Term *term, int);
+void st_scroll(Term *term, int n);
 int st_set_cursor(Term *term, int cursor);
 
 void st_on_poll(int fd, void *data, int events);
@@ -294,6 +392,16 @@ extern unsigned int tabspaces;
 extern unsigned int defaultfg;
 extern unsigned int defaultbg;
 extern unsigned int blinktimeout;
+extern unsigned int synctimeout;
+extern unsigned int readbudget;
+extern int readthread;
+extern unsigned int backlogmax;
+extern unsigned int ptyslice;
+extern unsigned int strmax;
+extern unsigned int histlines;
+extern unsigned int histhot;
+extern size_t histspill;
+extern size_t histbytes;
 extern int customcursor;
 
 #endif
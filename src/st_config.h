@@ -64,6 +64,68 @@ static double maxlatency = 33;
  */
 unsigned int blinktimeout = 700;
 
+/*
+ * scrollback kept for each job: at most histlines lines using at most
+ * histbytes of memory and spill file, the oldest lines are dropped first.
+ */
+unsigned int histlines = 1000000;
+size_t histbytes = 256 * 1024 * 1024;
+
+/*
+ * the most recent histhot lines of scrollback are kept as they are, older
+ * ones are compressed and only expanded again when drawn.
+ */
+unsigned int histhot = 200;
+
+/*
+ * once a job's scrollback takes more than histspill of memory, its oldest
+ * lines are moved to a temporary file in TMPDIR or /tmp (0 keeps it all in
+ * memory). Like histbytes this is for each job, there is no cap across jobs,
+ * and the file can grow to about twice the lines it holds. /tmp is often a
+ * tmpfs, where the file takes memory too; point TMPDIR at a disk to avoid it.
+ */
+size_t histspill = 4 * 1024 * 1024;
+
+/*
+ * longest time in millis a synchronized update (private mode 2026) may hold
+ * back drawing, in case the application never ends it.
+ */
+unsigned int synctimeout = 150;
+
+/*
+ * bytes read from each pty per frame. A job flooding output stops being read
+ * for the rest of the frame once it has used this up, so it cannot starve the
+ * other jobs or the UI.
+ */
+unsigned int readbudget = 256 * 1024;
+
+/*
+ * read pty output on a dedicated thread, which keeps reading while the UI
+ * thread is busy drawing, leaving the UI thread to only process it
+ */
+int readthread = 1;
+
+/*
+ * unread bytes of pty output the reader thread buffers for a job. Once a job
+ * is this far behind, its pty is not read until the backlog is processed, so
+ * the kernel's pty flow control stops the job from writing more, and the job
+ * is shown as throttled. Only applies with readthread, otherwise the pty is
+ * left unread for the rest of a frame once readbudget is used up.
+ */
+unsigned int backlogmax = 512 * 1024;
+
+/*
+ * milliseconds the main loop spends processing pty output before it goes
+ * back to check for keyboard input
+ */
+unsigned int ptyslice = 8;
+
+/*
+ * max bytes of a string sequence (OSC, DCS, ...) and of decoded OSC 52
+ * clipboard data. Longer sequences are dropped.
+ */
+unsigned int strmax = 8 * 1024 * 1024;
+
 /*
  * thickness of underline and bar cursors
  */
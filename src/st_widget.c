@@ -3,12 +3,14 @@
  */
 
 #include "BearLibTerminal.h"
+#include "frame.h"
 #include "st_widget.h"
 
 void xbell(void) {}
 void xclipcopy(void) {}
 
-void draw_line(Line line, int x1, int y1, int x2) {
+/* Draw glyphs from line, their styles index the colors in styles */
+void draw_line(Line line, const Style *styles, int x1, int y1, int x2) {
     Glyph last = (Glyph){};
     Glyph *this = line;
     terminal_bkcolor(0xff000000);
@@ -18,11 +20,12 @@ void draw_line(Line line, int x1, int y1, int x2) {
         if (this->mode == ATTR_WDUMMY) continue;
         // TODO handle selection
         /*
-        if (this.bg != last.bg) {
-            terminal_bkcolor(this.bg);
+        const Style *st = &styles[this->style];
+        if (st->bg != styles[last.style].bg) {
+            terminal_bkcolor(st->bg);
         }
-        if (this.fg != last.fg) {
-            terminal_color(this.fg);
+        if (st->fg != styles[last.style].fg) {
+            terminal_color(st->fg);
         }
         */
         // TODO support styles
@@ -41,13 +44,21 @@ void xsetsel(char *str) {}
 
 void st_update(widget_t *w, unsigned int dt) {
     Term *term = widget_data(w, &st_widget);
+    st_reset_budget(term);
+    if (st_syncing(term)) {
+        /* make sure to draw when the synchronized update times out */
+        frame_request(synctimeout - (frame_millis() - term->syncstart));
+    }
     if (!IS_SET(MODE_FOCUSED) || !blinktimeout) return;
     term->blinkelapsed += dt;
     if (term->blinkelapsed >= blinktimeout) {
-        term->blinkelapsed -= blinktimeout;
+        term->blinkelapsed %= blinktimeout;
         term->mode ^= MODE_BLINK;
-        w->flags |= WIDGET_NEEDS_REDRAW;
+        /* redraw only the lines with blinking glyphs */
+        if (tattrset(term, ATTR_BLINK))
+            tsetdirtattr(term, ATTR_BLINK);
     }
+    frame_request(blinktimeout - term->blinkelapsed);
 }
 
 void st_layout(widget_t *w) {
@@ -59,58 +70,105 @@ void st_layout(widget_t *w) {
         printf("resize!\n");
         tresize(term, w->width, term->row);
     }
+    /* keep the height until the synchronized update is complete */
+    if (st_syncing(term)) return;
     w->max_height = term->nlines;
     if (term->c.y >= term->nlines && IS_SET(MODE_FOCUSED)) {
         /* ensure widget encloses cursor when focused */
         w->max_height = term->c.y + 1;
     }
+    /* the scrollback goes above the screen */
+    if (!IS_SET(MODE_ALTSCREEN)) {
+        w->max_height += term->hist.n + term->hist.nspill;
+    }
 }
 
 void
 st_draw(widget_t *w)
 {
     Term *term = widget_data(w, &st_widget);
-    int cx = term->c.x, ocx = term->ocx, ocy = term->ocy;
+    int cx = term->c.x;
+    int lastline = MIN(term->nlines-1, term->row-1);
+    if (IS_SET(MODE_FOCUSED)) {
+        /* the layout makes room for the cursor's line */
+        lastline = MAX(lastline, term->c.y);
+    }
     /*
     if (!IS_SET(MODE_VISIBLE)) return;
     */
 
     /* adjust cursor position */
-    LIMIT(term->ocx, 0, term->col-1);
-    LIMIT(term->ocy, 0, term->row-1);
-    if (term->line[term->ocy][term->ocx].mode & ATTR_WDUMMY)
-        term->ocx--;
     if (term->line[term->c.y][cx].mode & ATTR_WDUMMY)
         cx--;
 
-    int moved = term->lastx != w->left || term->lasty != w->top;
+    /* lines of the history and screen scrolled out below the widget */
+    int nhist = IS_SET(MODE_ALTSCREEN) ? 0 : term->hist.n + term->hist.nspill;
+    int skip = MIN(term->scroll, lastline + 1 + nhist - w->height);
+    if (skip < 0 || IS_SET(MODE_ALTSCREEN))
+        skip = 0;
+    term->scroll = skip;
+
+    /*
+     * Unless the lines moved on screen, only draw the changed part of each
+     * line, what was drawn before is still there.
+     */
+    int full = (w->flags & WIDGET_NEEDS_REDRAW) || term->lastx != w->left
+        || term->lasty != w->top || term->lastline != lastline
+        || term->lasthist != term->hist.changes
+        || term->lastscroll != skip;
     int y = w->top + w->height - 1;
-    for (int row = MIN(term->nlines-1, term->row-1); row >= 0 && y >= w->top; row--, y--) {
-        //if (!moved && !term->dirty[row]) continue;
-        term->dirty[row] = 0;
-        draw_line(term->line[row], w->left, y, w->left + term->col);
+
+    /* leave the screen as it is until the synchronized update is complete */
+    if (st_syncing(term) && !(w->flags & WIDGET_NEEDS_REDRAW)
+            && term->lastx == w->left && term->lasty == w->top)
+        return;
+
+    if (!full && term->ocy >= 0) {
+        /* remove old cursor */
+        int row = lastline - skip - (y - term->ocy);
+        int col = term->ocx - w->left;
+        if (row >= 0 && BETWEEN(col, 0, term->col-1)) {
+            draw_line(&term->line[row][col], term->styles.data, term->ocx, term->ocy, term->ocx + 1);
+        } else {
+            terminal_bkcolor(0xff000000);
+            terminal_put(term->ocx, term->ocy, ' ');
+        }
+    }
+
+    for (int row = lastline - skip; row >= 0 && y >= w->top; row--, y--) {
+        LineDamage *d = &term->dirty[row];
+        if (full || d->scrolled) {
+            draw_line(term->line[row], term->styles.data, w->left, y, w->left + term->col);
+        } else if (d->x1 <= d->x2) {
+            draw_line(&term->line[row][d->x1], term->styles.data,
+                    w->left + d->x1, y, w->left + d->x2 + 1);
+        }
+        *d = (LineDamage){ .x1 = 1, .x2 = 0 };
+    }
+
+    /* history lines don't change, they only move when the screen scrolls */
+    for (int i = MAX(skip - lastline - 1, 0); full && i < nhist
+            && y >= w->top; i++, y--) {
+        int len;
+        const Style *styles;
+        Line line = thist(term, i, &len, &styles);
+        len = MIN(len, term->col);
+        draw_line(line, styles, w->left, y, w->left + len);
+        if (len < term->col) {
+            terminal_clear_area(w->left + len, y, term->col - len, 1);
+        }
     }
 
     /* draw cursor */
-    int cy = term->c.y < w->height ? w->top + term->c.y : -1;
-    cx += w->left;
+    int cy = w->top + w->height - 1 - (lastline - term->c.y) + skip;
     Glyph cg = term->line[term->c.y][cx];
-    Glyph ocg = term->line[term->ocy][term->ocx];
     int offx = 0, offy = 0;
 
-    /*
-    if (!moved) {
-        * remove old cursor *
-        if (term->cursorshape > 2) {
-            terminal_layer(1);
-            terminal_put(term->lastx + ocx, term->lasty + ocy, 0);
-            terminal_layer(0);
-        } else {
-            terminal_put(term->lastx + ocx, term->lasty + ocy, ocg.u);
-        }
-    }
-    */
-    if (term->c.y < w->height && !IS_SET(MODE_HIDE) && !IS_SET(MODE_BLINK) && IS_SET(MODE_FOCUSED)) {
+    cx += w->left;
+    term->ocy = -1;
+    if (cy >= w->top && cy < w->top + w->height && !IS_SET(MODE_HIDE) && !IS_SET(MODE_BLINK) && IS_SET(MODE_FOCUSED)) {
+        term->ocx = cx;
+        term->ocy = cy;
         // TODO handle selection and colors
 
         if (term->cursorshape <= 2) {
@@ -145,10 +203,11 @@ st_draw(widget_t *w)
         }
     }
 
-    term->ocx = cx;
-    term->ocy = term->c.y;
     term->lastx = w->left;
     term->lasty = w->top;
+    term->lastline = lastline;
+    term->lasthist = term->hist.changes;
+    term->lastscroll = skip;
 }
 
 widget_cls st_widget = {
@@ -5,15 +5,17 @@
 #include <string.h>
 #include <unistd.h>
 #include <libgen.h>
-#include <sys/time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <dlfcn.h>
 #include <pthread.h>
+#include <signal.h>
 
 #if   defined(__linux)
  #include <pty.h>
+ #include <sys/signalfd.h>
+ #define TERSH_SIGNALFD
 #elif defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__)
  #include <util.h>
 #elif defined(__FreeBSD__) || defined(__DragonFly__)
@@ -35,12 +37,14 @@
 #include "lineedit.h"
 #include "vec.h"
 #include "poller.h"
+#include "frame.h"
 #include "widget.h"
 #include "st_widget.h"
 #include "st.h"
 #include "ui.h"
 
-#define FRAME_TIME 30
+/* How often input is checked while waiting on the poller */
+#define INPUT_POLL_TIME FRAME_TIME
 
 struct program_ctx {
     Term *term;
@@ -59,6 +63,16 @@ pid_t main_pid;
 int orig_fds[3];
 extern char **environ;
 
+/*
+ * Set when a child may have changed state and mrsh jobs need polling. Without
+ * a SIGCHLD signalfd this is never cleared, so jobs are polled every loop.
+ */
+bool jobs_changed = true;
+int sigchld_fd = -1;
+/* Set when the program thread has returned, written to wake the poller */
+bool program_finished = false;
+int program_pipe[2] = {-1, -1};
+
 /* Ensure exit() calls in child processes do not have side effects */
 extern void exit(int status) {
     _exit(status);
@@ -66,6 +80,11 @@ extern void exit(int status) {
 
 /* Ensure our direct children have the proper controlling tty */
 void atfork_child() {
+    sigset_t mask;
+    /* SIGCHLD is blocked in tersh for the signalfd, don't pass that on */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
     if (getppid() == main_pid) {
         struct winsize w = {
             .ws_row = terminal_state(TK_HEIGHT),
@@ -95,44 +114,88 @@ extern int setpgid(pid_t pid, pid_t pgid) {
     return sys_setpgid(pid, pgid);
 }
 
-long long time_millis(void)
-{
-    struct timeval tv;
-    long long msec;
-
-    gettimeofday(&tv, NULL);
-
-    msec = tv.tv_sec;
-    msec *= 1000;
-    msec += tv.tv_usec / 1000;
-
-    return msec;
+/* keys for the foreground job, written to its pty together */
+static vec_char_t key_batch = NULL_VEC;
+/* the most recently started job, scrolled when there is no foreground job */
+static Term *newest_term = NULL;
+
+/*
+ * Handle a key read from the terminal. Returns false if the rest of this
+ * loop iteration should be skipped.
+ */
+static bool handle_key(Term *fg_term, int key) {
+    frame_damage();
+    if (key == TK_CLOSE) {
+        running = false;
+        return false;
+    }
+    if (key == TK_RESIZED) {
+        root_w->min_width = terminal_state(TK_WIDTH),
+            root_w->max_width = terminal_state(TK_WIDTH),
+            root_w->min_height = terminal_state(TK_HEIGHT),
+            root_w->max_height = terminal_state(TK_HEIGHT),
+            widget_layout(root_w, 0, 0, terminal_state(TK_WIDTH), terminal_state(TK_HEIGHT));
+        terminal_clear();
+        widget_draw(root_w);
+        terminal_refresh();
+        return false;
+    }
+    if ((key == TK_PAGEUP || key == TK_PAGEDOWN) && terminal_check(TK_SHIFT)) {
+        /* scroll through the history half a window at a time */
+        Term *term = fg_term ? fg_term : newest_term;
+        int lines = terminal_state(TK_HEIGHT) / 2;
+        if (term) {
+            st_scroll(term, key == TK_PAGEUP ? lines : -lines);
+        }
+        return true;
+    }
+    if (fg_term) {
+        char ch;
+        switch (key) {
+            case TK_RETURN:
+                ch = '\n';
+                break;
+            case TK_TAB:
+                ch = '\t';
+                break;
+            case TK_BACKSPACE:
+                ch = 127;
+                break;
+            case TK_ESCAPE:
+                ch = '\e';
+                break;
+            default:
+                ch = terminal_state(TK_CHAR);
+        }
+        if (ch) {
+            /* typing goes back to the bottom */
+            st_scroll(fg_term, -fg_term->scroll);
+            vec_push(&key_batch, ch);
+        }
+    } else {
+        line_ed_w->cls->handle_ev(line_ed_w, key);
+    }
+    return true;
 }
 
-static void poll_events(bool delay) {
-    static long long last_time = 0;
-    long long now;
-    static int dt = 0;
+/*
+ * Handle all pending keyboard input, then wait for and dispatch pty and timer
+ * events.
+ *
+ * Input goes first so typing stays responsive while jobs flood output, and
+ * pty output is only processed for a ptyslice before yielding back to input.
+ * Terms cut short are continued on the next call.
+ *
+ * BearLibTerminal input cannot be waited on together with the poller, so
+ * input is checked every INPUT_POLL_TIME while waiting. When idle is set
+ * nothing is running or animating, so this sleeps until there is input.
+ */
+static void poll_events(bool idle) {
     static Term *last_term = NULL;
     Term *fg_term;
-
-    if (last_time == 0) {
-        last_time = time_millis();
-    }
-
-    if (!terminal_has_input()) {
-        do {
-            if (poller_poll(FRAME_TIME - dt) > 0 && !terminal_has_input() && delay) {
-                terminal_delay(FRAME_TIME - dt);
-            }
-            now = time_millis();
-            dt = now - last_time;
-        } while (!terminal_has_input() && dt < FRAME_TIME);
-
-        widget_update(root_w, dt);
-        last_time = now;
-        dt = 0;
-    }
+    bool had_input = false;
+    bool ok = true;
+    int timeout;
 
     struct mrsh_job *fg_job = job_get_foreground(mrsh_state);
     // if (fg_job) dprintf(orig_fds[1], "FG %p data=%p\n", fg_job, fg_job->data);
@@ -145,55 +208,47 @@ static void poll_events(bool delay) {
         if (last_term) st_set_focused(last_term, 0);
         if (fg_term) st_set_focused(fg_term, 1);
         last_term = fg_term;
+        frame_damage();
     }
 
-    if (terminal_has_input()) {
-        int key = terminal_read();
-        if (key == TK_CLOSE) {
-            running = false;
-            return;
-        }
-        if (key == TK_RESIZED) {
-            root_w->min_width = terminal_state(TK_WIDTH),
-                root_w->max_width = terminal_state(TK_WIDTH),
-                root_w->min_height = terminal_state(TK_HEIGHT),
-                root_w->max_height = terminal_state(TK_HEIGHT),
-                widget_layout(root_w, 0, 0, terminal_state(TK_WIDTH), terminal_state(TK_HEIGHT));
-            widget_draw(root_w);
-            terminal_refresh();
-            return;
-        }
-        if (fg_term) {
-            char ch;
-            switch (key) {
-                case TK_RETURN:
-                    ch = '\n';
-                    break;
-                case TK_TAB:
-                    ch = '\t';
-                    break;
-                case TK_BACKSPACE:
-                    ch = 127;
-                    break;
-                case TK_ESCAPE:
-                    ch = '\e';
-                    break;
-                default:
-                    ch = terminal_state(TK_CHAR);
-            }
-            if (ch) {
-                ttywrite(fg_term, &ch, 1, 1);
-            }
-        } else {
-            line_ed_w->cls->handle_ev(line_ed_w, key);
+    if (idle) {
+        ok = handle_key(fg_term, terminal_read());
+        had_input = true;
+    }
+    while (ok && terminal_has_input()) {
+        ok = handle_key(fg_term, terminal_read());
+        had_input = true;
+    }
+    /* a single write for all the keys, pastes included */
+    if (key_batch.length) {
+        ttywrite(fg_term, key_batch.data, key_batch.length, 1);
+        vec_clear(&key_batch);
+    }
+    if (!ok) return;
+
+    st_slice_begin();
+    if (had_input || st_run_deferred()) {
+        /* don't wait, there is work to get back to */
+        timeout = 0;
+    } else {
+        timeout = frame_timeout();
+        if (timeout < 0 || timeout > INPUT_POLL_TIME) {
+            timeout = INPUT_POLL_TIME;
         }
     }
+    if (!idle) {
+        poller_poll(timeout);
+    }
+    st_slice_end();
 }
 
 void poll_jobs() {
+    if (!jobs_changed) return;
     if (pthread_mutex_trylock(&mrsh_mutex)) return;
+    if (sigchld_fd >= 0) jobs_changed = false;
     struct mrsh_job **jobs = mrsh_poll_jobs(mrsh_state);
     if (jobs != NULL) {
+        frame_damage();
         for (int i = 0; jobs[i] != NULL; i++) {
             dprintf(orig_fds[1], "POLLED JOB %p\n", jobs[i]);
             Term *term = jobs[i]->data;
@@ -210,9 +265,72 @@ void poll_jobs() {
     pthread_mutex_unlock(&mrsh_mutex);
 }
 
+#ifdef TERSH_SIGNALFD
+static void on_sigchld(int fd, void *data, int events) {
+    struct signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == sizeof(info))
+        ;
+    jobs_changed = true;
+}
+
+/*
+ * Deliver SIGCHLD through a signalfd watched by the poller, so jobs are only
+ * polled when a child actually changed state. SIGCHLD must be blocked in all
+ * threads for this, so it should be called before any threads are created.
+ */
+static void init_sigchld_fd() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) return;
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd < 0) {
+        perror("tersh: signalfd failed, polling jobs instead");
+        pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+        return;
+    }
+    if (poller_add(sigchld_fd, NULL, on_sigchld) < 0) {
+        perror("tersh: failed to poll signalfd, polling jobs instead");
+        close(sigchld_fd);
+        sigchld_fd = -1;
+        pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    }
+}
+#endif
+
+static void on_program_returned(int fd, void *data, int events) {
+    char c;
+    while (read(fd, &c, 1) == 1)
+        ;
+    program_finished = true;
+}
+
+/*
+ * The program thread writes to program_pipe when it returns, so the main
+ * loop finds out right away instead of checking on every iteration.
+ */
+static int init_program_pipe() {
+    if (pipe(program_pipe) < 0) return -1;
+    for (int i = 0; i < 2; i++) {
+        fcntl(program_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(program_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+    return poller_add(program_pipe[0], NULL, on_program_returned);
+}
+
+static void wake_program_pipe() {
+    /* a full pipe already has a wakeup pending */
+    if (write(program_pipe[1], "", 1) < 0 && errno != EAGAIN) {
+        perror("tersh: program pipe write failed");
+    }
+}
+
 static void refresh() {
     widget_relayout(root_w);
-    terminal_clear();
+    if (root_w->flags & WIDGET_MOVED) {
+        /* the layout changed, start over from a blank screen */
+        terminal_clear();
+    }
     widget_draw(root_w);
     terminal_refresh();
 }
@@ -228,7 +346,8 @@ static int init_program_pty(struct program_ctx *prog) {
     }
     assert(m > 2 && s > 2); // Guard against std fds being accidentally closed
     int flags = fcntl(m, F_GETFL, 0);
-    if (fcntl(m, F_SETFL, flags | O_CLOEXEC) < 0) {
+    if (fcntl(m, F_SETFL, flags | O_NONBLOCK) < 0 ||
+        fcntl(m, F_SETFD, FD_CLOEXEC) < 0) {
         st_perror(prog->term, "tersh: fcntl failed to set pty flags");
     }
     if (dup2(s, 0) < 0 ||
@@ -241,19 +360,22 @@ static int init_program_pty(struct program_ctx *prog) {
         return -1;
     }
     close(s);
-    prog->term->cmdfd = m;
-    poller_add(m, prog->term, st_on_poll);
+    st_attach_pty(prog->term, m);
     return 0;
 }
 
 static void update_program(struct program_ctx *prog) {
-    if (!prog->started) return;
+    if (!prog->started || !program_finished) return;
     if (pthread_mutex_trylock(&mrsh_mutex)) return;
     if (!prog->returned) {
         pthread_mutex_unlock(&mrsh_mutex);
         return;
     }
-    poll_events(0); // Ensure all data is read
+    program_finished = false;
+    jobs_changed = true;
+    st_run_deferred();
+    poller_poll(0); // Ensure all data is read
+    frame_damage();
     if (prog->status >= 0) {
         st_set_child_status(prog->term, prog->status);
     }
@@ -273,12 +395,15 @@ static void *run_program_thread(void *data) {
     if (err) {
         fprintf(stderr, "tersh: failed to get program lock: %s\n", strerror(err));
         prog->returned = true;
+        wake_program_pipe();
         pthread_exit(NULL);
     }
     mrsh_state->job_data = prog->term;
     prog->status = mrsh_run_program(mrsh_state, prog->mrsh_prog);
     prog->returned = true;
     pthread_mutex_unlock(&mrsh_mutex);
+    /* wake the main loop, after unlocking so update_program gets the lock */
+    wake_program_pipe();
     pthread_exit(NULL);
 }
 
@@ -286,6 +411,7 @@ void handle_sigalrm() {
     // TODO check current thread
     if (getpid() != main_pid) return;
     poll_events(false);
+    widget_update(root_w, frame_begin());
     refresh();
 }
 
@@ -296,6 +422,13 @@ int main(int argc, char* argv[]) {
     for (int i = 0; i <= 2; i++) {
         orig_fds[i] = dup(i);
     }
+#ifdef TERSH_SIGNALFD
+    init_sigchld_fd();
+#endif
+    if (init_program_pipe() < 0) {
+        perror("tersh: failed to create program pipe");
+        return 1;
+    }
     char *path = strdup(argv[0]);
     char *dirpath = dirname(path);
 
@@ -344,6 +477,7 @@ int main(int argc, char* argv[]) {
 
     lineedit_t le = (lineedit_t){
         .blink_time = 700,
+        .blink_timeout = 10000,
     };
 
     line_ed_w = widget_new((widget_t){
@@ -374,8 +508,14 @@ int main(int argc, char* argv[]) {
     widget_draw(root_w);
     terminal_refresh();
 
+    if (frame_init() < 0) {
+        perror("tersh: failed to create frame timer");
+    }
+    frame_damage();
+
     while (running && lineedit_state(line_ed_w) != lineedit_cancelled) {
-        poll_events(true);
+        poll_events(!program.started && !frame_scheduled()
+                    && !st_ptys_open());
         update_program(&program);
         poll_jobs();
         if (!program.started && lineedit_state(line_ed_w) == lineedit_confirmed) {
@@ -391,6 +531,7 @@ int main(int argc, char* argv[]) {
                 mrsh_buffer_append(&parser_buffer, cmd, le.buf.length);
                 mrsh_parser_reset(parser);
                 job_widget_new(term_container, --term_order, term, le.buf.data, le.buf.length);
+                newest_term = term;
                 struct mrsh_program *prog = mrsh_parse_line(parser);
                 if (prog != NULL) {
                     program = (struct program_ctx){
@@ -427,8 +568,12 @@ int main(int argc, char* argv[]) {
                 }
             }
             lineedit_clear(line_ed_w);
+            frame_damage();
+        }
+        if (frame_due()) {
+            widget_update(root_w, frame_begin());
+            refresh();
         }
-        refresh();
     }
 
     mrsh_state_destroy(mrsh_state);
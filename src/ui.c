@@ -1,7 +1,9 @@
 #include <wchar.h>
 #include "BearLibTerminal.h"
+#include "frame.h"
 #include "st.h"
 #include "ui.h"
+#include "width.h"
 
 /*
  * label widget
@@ -11,8 +13,10 @@ int label_set_text(widget_t *w, wchar_t *s, size_t len) {
     if (!w->data) return -1;
     wcsncpy(w->data, s, len);
     ((wchar_t *)w->data)[len] = 0;
-    dimensions_t dims = terminal_wmeasure(w->data);
-    w->max_width = dims.width;
+    w->max_width = 0;
+    for (size_t i = 0; i < len && s[i]; i++) {
+        w->max_width += char_width(s[i]);
+    }
     return 0;
 }
 
@@ -51,7 +55,7 @@ void container_set_bkcolor(widget_t *w, int bkcolor) {
 }
 
 void container_draw(widget_t *w) {
-    if (!w->data_int) return;
+    if (!w->data_int || !(w->flags & WIDGET_NEEDS_REDRAW)) return;
     terminal_bkcolor(w->data_int);
     terminal_clear_area(w->left, w->top, w->width, w->height);
     terminal_layer(1);
@@ -81,6 +85,7 @@ const int spinner_frame_time = 100;
 void job_spinner_update(widget_t *w, unsigned int dt) {
     if (w->data_int >= 0) {
         w->data_int += dt;
+        frame_request(spinner_frame_time - w->data_int % spinner_frame_time);
     }
 }
 
@@ -129,6 +134,29 @@ widget_cls job_spinner_widget = {
     .draw = job_spinner_draw,
 };
 
+/*
+ * job throttle indicator widget, shown while a job writes output faster
+ * than it can be displayed
+ */
+
+void job_throttle_set(widget_t *w, int throttled) {
+    if (w->data_int == throttled) return;
+    w->data_int = throttled;
+    /* the status bar clears the indicator */
+    w->parent->flags |= WIDGET_NEEDS_REDRAW;
+}
+
+void job_throttle_draw(widget_t *w) {
+    if (!w->data_int) return;
+    terminal_color(0xffffaa00);
+    terminal_put(w->left, w->top, 0x29D7);
+}
+
+widget_cls job_throttle_widget = {
+    .name = "job throttle",
+    .draw = job_throttle_draw,
+};
+
 /*
  * job widget
  */
@@ -179,6 +207,13 @@ widget_t *job_widget_new(widget_t *parent, int order, Term *term, wchar_t *cmd,
     });
     if (cmd_label == NULL) return NULL;
     label_set_text(cmd_label, cmd, cmd_len);
+    widget_new((widget_t){
+        .cls = &job_throttle_widget,
+        .parent = status,
+        .anchor = ANCHOR_RIGHT,
+        .min_width = 2,
+        .min_height = 1,
+    });
     return job;
 }
 
@@ -189,6 +224,9 @@ void job_update(widget_t *w, unsigned int dt) {
     widget_t *status = w->children.data[1];
     widget_t *spinner = status->children.data[0];
     // widget_t *cmd = status->children.data[1];
+    if (status->children.length >= 3) {
+        job_throttle_set(status->children.data[2], term->throttled);
+    }
     if (term->childexited) {
         if (term->childexitst == 0) {
             job_spinner_set(spinner, JOB_EXIT_ZERO);
@@ -110,11 +110,12 @@ which will send SIGSTOP
 #define JOB_STOPPED -4
 #define JOB_CMD_ERROR -5
 
-widget_cls label_widget, container_widget, job_spinner_widget, job_widget;
+widget_cls label_widget, container_widget, job_spinner_widget, job_throttle_widget, job_widget;
 
 int label_set_text(widget_t *w, wchar_t *s, size_t len);
 void container_set_bkcolor(widget_t *w, int bkcolor);
 void job_spinner_set(widget_t *w, int status);
+void job_throttle_set(widget_t *w, int throttled);
 widget_t *job_widget_new(widget_t *parent, int order, Term *term, wchar_t *cmd, size_t cmd_len);
 
 #endif
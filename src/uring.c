@@ -0,0 +1,181 @@
+#include "uring.h"
+
+#ifdef URING_AVAILABLE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int uring_register(uring_t *u, unsigned op, void *arg, unsigned nr) {
+    return syscall(__NR_io_uring_register, u->fd, op, arg, nr);
+}
+
+/* Check the running kernel supports what the pty reader needs */
+static int uring_probe(uring_t *u) {
+    struct io_uring_probe *probe;
+    size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int ok;
+
+    probe = calloc(1, len);
+    if (probe == NULL) return -1;
+    ok = uring_register(u, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        probe->last_op >= URING_OP_READ_MULTISHOT &&
+        (probe->ops[URING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok ? 0 : -1;
+}
+
+int uring_init(uring_t *u, unsigned entries) {
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *sq, *cq;
+    unsigned i;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || uring_probe(u) < 0) {
+        goto error;
+    }
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->rings_len = sq_len > cq_len ? sq_len : cq_len;
+    u->rings = mmap(NULL, u->rings_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->rings == MAP_FAILED) goto error;
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        munmap(u->rings, u->rings_len);
+        goto error;
+    }
+
+    sq = cq = u->rings;
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sq_local_tail = u->sq_submitted = *u->sq_tail;
+    /* sqes are always used in order */
+    for (i = 0; i < p.sq_entries; i++) {
+        u->sq_array[i] = i;
+    }
+    return 0;
+
+error:
+    close(u->fd);
+    u->fd = -1;
+    return -1;
+}
+
+void uring_deinit(uring_t *u) {
+    if (u->fd < 0) return;
+    munmap(u->sqes, u->sqes_len);
+    munmap(u->rings, u->rings_len);
+    close(u->fd);
+    u->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *u) {
+    struct io_uring_sqe *sqe;
+
+    if (u->sq_local_tail - u->sq_submitted > *u->sq_mask) {
+        if (uring_submit(u, 0) < 0) return NULL;
+        if (u->sq_local_tail - u->sq_submitted > *u->sq_mask) return NULL;
+    }
+    sqe = &u->sqes[u->sq_local_tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_local_tail++;
+    return sqe;
+}
+
+int uring_submit(uring_t *u, unsigned wait_nr) {
+    unsigned to_submit = u->sq_local_tail - u->sq_submitted;
+    int r;
+
+    store_release(u->sq_tail, u->sq_local_tail);
+    r = syscall(__NR_io_uring_enter, u->fd, to_submit, wait_nr,
+            wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (r > 0) u->sq_submitted += r;
+    return r;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *u) {
+    unsigned head = *u->cq_head;
+    if (head == load_acquire(u->cq_tail)) return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *u) {
+    store_release(u->cq_head, *u->cq_head + 1);
+}
+
+int uring_bufs_init(uring_t *u, uring_bufs_t *b, int bgid,
+        unsigned nbufs, unsigned size) {
+    struct io_uring_buf_reg reg;
+    size_t ring_len = nbufs * sizeof(struct io_uring_buf);
+    unsigned i;
+
+    b->br = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (b->br == MAP_FAILED) return -1;
+    b->data = malloc((size_t)nbufs * size);
+    if (b->data == NULL) goto unmap;
+    b->nbufs = nbufs;
+    b->size = size;
+    b->bgid = bgid;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)b->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    if (uring_register(u, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        free(b->data);
+        goto unmap;
+    }
+    for (i = 0; i < nbufs; i++) {
+        uring_buf_recycle(b, i);
+    }
+    return 0;
+
+unmap:
+    munmap(b->br, ring_len);
+    return -1;
+}
+
+void uring_bufs_deinit(uring_t *u, uring_bufs_t *b) {
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = b->bgid;
+    uring_register(u, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(b->br, b->nbufs * sizeof(struct io_uring_buf));
+    free(b->data);
+}
+
+char *uring_buf(uring_bufs_t *b, int bid) {
+    return b->data + (size_t)bid * b->size;
+}
+
+void uring_buf_recycle(uring_bufs_t *b, int bid) {
+    unsigned short tail = b->br->tail;
+    struct io_uring_buf *buf = &b->br->bufs[tail & (b->nbufs - 1)];
+
+    /* bufs[0].resv doubles as the tail, so leave it alone */
+    buf->addr = (unsigned long)uring_buf(b, bid);
+    buf->len = b->size;
+    buf->bid = bid;
+    store_release(&b->br->tail, tail + 1);
+}
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Minimal io_uring wrapper, just enough for multishot reads into provided
+ * buffer rings. Talks to the kernel directly, so it doesn't need liburing.
+ *
+ * A uring_t must only be used by one thread.
+ */
+#if defined(__linux)
+ #include <linux/version.h>
+ /* for provided buffer rings, multishot reads are probed at runtime */
+ #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+  #define URING_AVAILABLE
+ #endif
+#endif
+
+#ifndef URING_H
+#define URING_H
+
+#ifdef URING_AVAILABLE
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/* Added in Linux 6.7, missing from older headers */
+#define URING_OP_READ_MULTISHOT 49
+
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t rings_len, sqes_len;
+    unsigned sq_local_tail; /* includes sqes not submitted yet */
+    unsigned sq_submitted;
+} uring_t;
+
+/* Provided buffers the kernel picks from for buffer select reads */
+typedef struct {
+    struct io_uring_buf_ring *br;
+    char *data;
+    unsigned nbufs;
+    unsigned size;  /* bytes per buffer */
+    int bgid;
+} uring_bufs_t;
+
+/*
+ * Set up a ring with room for entries submissions. Returns 0 on success, -1
+ * if io_uring is not available, or lacks multishot reads or provided buffer
+ * rings.
+ */
+int uring_init(uring_t *u, unsigned entries);
+
+void uring_deinit(uring_t *u);
+
+/*
+ * Returns a cleared submission queue entry to fill in, submitting the
+ * pending ones first if the queue is full. Returns NULL on error.
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *u);
+
+/*
+ * Submit the pending entries and wait until at least wait_nr completions
+ * are available. Returns like io_uring_enter().
+ */
+int uring_submit(uring_t *u, unsigned wait_nr);
+
+/*
+ * Returns the next completion, or NULL if there is none. Call
+ * uring_cqe_seen() once done with it.
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *u);
+void uring_cqe_seen(uring_t *u);
+
+/*
+ * Register nbufs buffers of size bytes as buffer group bgid. nbufs must be a
+ * power of two. Returns 0 on success, -1 on error.
+ */
+int uring_bufs_init(uring_t *u, uring_bufs_t *b, int bgid,
+        unsigned nbufs, unsigned size);
+void uring_bufs_deinit(uring_t *u, uring_bufs_t *b);
+
+/*
+ * Returns buffer bid's memory.
+ */
+char *uring_buf(uring_bufs_t *b, int bid);
+
+/*
+ * Give buffer bid back to the kernel to be filled again.
+ */
+void uring_buf_recycle(uring_bufs_t *b, int bid);
+
+#endif
+#endif
@@ -12,6 +12,7 @@ widget_t *widget_new(widget_t config) {
     if (w == NULL) return NULL;
     memcpy(w, &config, sizeof(widget_t));
     vec_init(&w->children);
+    w->flags |= WIDGET_NEEDS_REDRAW | WIDGET_MOVED;
     if (w->parent) {
         vec_push(&w->parent->children, w);
         if (w->order) {
@@ -55,6 +56,7 @@ void widget_del(widget_t *w) {
                 break;
             }
         }
+        w->parent->flags |= WIDGET_NEEDS_REDRAW | WIDGET_MOVED;
     }
     del_recursive(w);
 }
@@ -91,7 +93,13 @@ static void place_widget(widget_t *w, int left, int top, int right, int bottom)
     printf("place %s l=%d t=%d w=%d h=%d\n",
         w->cls->name, w->left, w->top, w->width, w->height);
     */
-    w->flags |= WIDGET_NEEDS_REDRAW;
+}
+
+static void check_moved(widget_t *w, const widget_t *old) {
+    if (w->left != old->left || w->top != old->top ||
+            w->width != old->width || w->height != old->height) {
+        w->flags |= WIDGET_NEEDS_REDRAW | WIDGET_MOVED;
+    }
 }
 
 static int cmp_widgets(const void* a, const void* b) {
@@ -114,12 +122,14 @@ void widget_layout(widget_t *w, int left, int top, int right, int bottom) {
     int width = right - left;
     int max_width = w->max_width < 0 || w->max_width > width ? width : w->max_width;
     int min_width = w->min_width >= 0 ? w->min_width : max_width + w->min_width + 1;
+    widget_t old = *w;
 
     if (!w->children.length) {
         w->width = max_width > min_width ? max_width : min_width;
         w->height = max_height > min_height ? max_height : min_height;
         if (w->cls->layout) w->cls->layout(w);
         place_widget(w, left, top, right, bottom);
+        check_moved(w, &old);
         return;
     }
 
@@ -212,6 +222,13 @@ void widget_layout(widget_t *w, int left, int top, int right, int bottom) {
     } while (overflow > 0);
 
     place_widget(w, left, top, right, bottom);
+    check_moved(w, &old);
+    widget_t *child;
+    vec_foreach(&w->children, child, i) {
+        if (child->flags & WIDGET_MOVED) {
+            w->flags |= WIDGET_NEEDS_REDRAW | WIDGET_MOVED;
+        }
+    }
 }
 
 void widget_relayout(widget_t *w) {
@@ -222,13 +239,16 @@ void widget_draw(widget_t *w) {
     //terminal_crop(w->left, w->top, w->width, w->height);
     /* Note this leaves it up to the widget drawing routines to clear
      * the widget rect if it is needed */
+    int redraw = w->flags & WIDGET_NEEDS_REDRAW;
     if (w->cls->draw) w->cls->draw(w);
-    w->flags &= ~WIDGET_NEEDS_REDRAW;
+    w->flags &= ~(WIDGET_NEEDS_REDRAW | WIDGET_MOVED);
     if (w->children.length) {
         int i;
         widget_t *child;
         order_children(w);
         vec_foreach(&w->children, child, i) {
+            /* the parent may have drawn over its children */
+            if (redraw) child->flags |= WIDGET_NEEDS_REDRAW;
             widget_draw(child);
         }
     }
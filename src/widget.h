@@ -4,7 +4,18 @@
 #ifndef WIDGET_H
 #define WIDGET_H
 
+/*
+ * A widget with WIDGET_NEEDS_REDRAW set must draw all of itself, otherwise
+ * what it drew last is still on screen and it only needs to draw what
+ * changed. Redrawing a widget redraws its children too.
+ */
 #define WIDGET_NEEDS_REDRAW 0x01
+/*
+ * Set by widget_layout() when the widget moved or was resized, or one of
+ * its children did. A moved widget leaves stale cells behind, so the root
+ * having it set means the whole screen must be drawn again.
+ */
+#define WIDGET_MOVED 0x02
 
 #define CHILD_REORDER 0x0400
 
@@ -0,0 +1,24 @@
+/*
+ * Character widths in terminal cells, from a table generated by
+ * tools/gen_width.py. Unlike wcwidth(), this doesn't depend on the locale,
+ * so the terminal emulator and the UI agree on how wide text is.
+ */
+#include <stdint.h>
+
+#ifndef WIDTH_H
+#define WIDTH_H
+
+extern const unsigned char width_stage1[0x110000 >> 8];
+extern const unsigned char width_stage2[][64];
+
+/*
+ * Returns the number of cells c takes up: 0 for combining and other zero
+ * width characters, 2 for wide characters and 1 otherwise.
+ */
+static inline int char_width(uint32_t c) {
+    if (c < 0x7f) return c >= 0x20;
+    if (c >= 0x110000) return 1;
+    return (width_stage2[width_stage1[c >> 8]][(c & 0xff) >> 2] >> ((c & 3) * 2)) & 3;
+}
+
+#endif
@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+"""
+Generate src/width_table.c, the character width table used by char_width()
+in src/width.h, from the Unicode database of the Python running it.
+
+    python3 tools/gen_width.py > src/width_table.c
+
+Widths are 0 for combining, enclosing, format and other zero width
+characters, 2 for East Asian Wide and Fullwidth characters, and 1 otherwise.
+"""
+import sys
+import unicodedata
+
+BLOCK = 256
+MAX = 0x110000
+
+
+def width(c):
+    ch = chr(c)
+    cat = unicodedata.category(ch)
+    if c == 0x00AD:
+        return 1  # soft hyphen is shown
+    if cat in ('Mn', 'Me', 'Cf', 'Cc'):
+        return 0
+    if 0x1160 <= c <= 0x11FF or 0xD7B0 <= c <= 0xD7FF:
+        return 0  # Hangul jamo vowels and finals join the syllable
+    if unicodedata.east_asian_width(ch) in ('W', 'F'):
+        return 2
+    return 1
+
+
+def main():
+    widths = [width(c) for c in range(MAX)]
+    blocks = []
+    index = {}
+    stage1 = []
+    for start in range(0, MAX, BLOCK):
+        block = tuple(widths[start:start + BLOCK])
+        if block not in index:
+            index[block] = len(blocks)
+            blocks.append(block)
+        stage1.append(index[block])
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write('/* Generated by tools/gen_width.py from Unicode %s, do not edit */\n'
+              % unicodedata.unidata_version)
+    out.write('#include "width.h"\n\n')
+    out.write('const unsigned char width_stage1[%d] = {\n' % len(stage1))
+    for i in range(0, len(stage1), 16):
+        out.write('    ' + ', '.join('%d' % b for b in stage1[i:i + 16]) + ',\n')
+    out.write('};\n\n')
+    out.write('/* 2 bits per character, 4 characters per byte */\n')
+    out.write('const unsigned char width_stage2[%d][%d] = {\n'
+              % (len(blocks), BLOCK // 4))
+    for block in blocks:
+        packed = [block[i] | block[i + 1] << 2 | block[i + 2] << 4 | block[i + 3] << 6
+                  for i in range(0, BLOCK, 4)]
+        out.write('    {\n')
+        for i in range(0, len(packed), 16):
+            out.write('        ' + ', '.join('0x%02x' % b for b in packed[i:i + 16]) + ',\n')
+        out.write('    },\n')
+    out.write('};\n')
+
+
+if __name__ == '__main__':
+    main()